@@ -0,0 +1,42 @@
+-- Throughput of luapython.pmap over a CPU-bound Python helper against calling it in a plain Lua
+-- loop, for 1, 2, 4 ... worker processes.
+--
+--   lua bench/pmap.lua [max_workers] [items] [path_to_libpython.so]
+--
+-- luapython must be installed for the same Lua. Without a libpython path it is found through
+-- luapython.load().
+local max_workers, items, libpython = tonumber(arg[1]) or 8, tonumber(arg[2]) or 20000, arg[3]
+
+local luapython = require "luapython"
+if libpython then
+    luapython.loadNative(libpython)
+    for k, v in pairs(require "luapython.core") do luapython[k] = v end
+    luapython.initialize()
+else
+    luapython.load()
+end
+
+local ns = luapython.dict({})
+luapython.import("builtins").exec("def work(n):\n    s = 0\n    for i in range(n % 500 + 500):\n        s += i * i\n    return s\n", ns)
+local work = ns["work"]
+local clock = luapython.import("time").perf_counter
+
+local array = {}
+for i = 1, items do array[i] = i end
+
+local start = clock()
+local serial = {}
+for i = 1, items do serial[i] = work(array[i]) end
+local serial_rate = items / (clock() - start)
+
+print(string.format("%8s %16s %10s", "workers", "items/s", "speedup"))
+print(string.format("%8s %16.0f %10.2f", "serial", serial_rate, 1))
+local workers = 1
+while workers <= max_workers do
+    start = clock()
+    local result = luapython.pmap(work, array, {workers = workers})
+    local rate = items / (clock() - start)
+    assert(result[items] == serial[items])
+    print(string.format("%8d %16.0f %10.2f", workers, rate, rate / serial_rate))
+    workers = workers * 2
+end
@@ -0,0 +1,117 @@
+// Throughput of a CPU-bound Python helper called from N Lua states on N threads, once with every
+// state sharing the main interpreter and once with a sub-interpreter (and GIL) per state.
+//
+//   make bench
+//   ./bench/subinterpreters [max_threads] [calls_per_thread] [path_to_libpython.so]
+//
+// luapython must be installed for the same Lua and built with LIMITED_API=0 against Python 3.12+.
+// Without a libpython path every state finds it through luapython.load().
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const char* setup_script =
+    "local isolated, libpython = ...\n"
+    "local luapython = require \"luapython\"\n"
+    "if libpython then\n"
+    "    luapython.loadNative(libpython)\n"
+    "    for k, v in pairs(require \"luapython.core\") do luapython[k] = v end\n"
+    "    luapython.initialize({isolated = isolated})\n"
+    "else\n"
+    "    luapython.load(nil, nil, {isolated = isolated})\n"
+    "end\n"
+    "local ns = luapython.dict({})\n"
+    "luapython.import(\"builtins\").exec(\"def work(n):\\n    s = 0\\n    for i in range(n):\\n        s += i * i\\n    return s\\n\", ns)\n"
+    "work = ns[\"work\"]\n"
+    "return luapython\n";
+
+static const char* run_script =
+    "local calls = ...\n"
+    "for i = 1, calls do work(2000) end\n";
+
+typedef struct {
+    int isolated;
+    int calls;
+    const char* libpython;
+    double seconds;
+} Worker;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static lua_State* newState(int isolated, const char* libpython) {
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    if (luaL_loadstring(L, setup_script) != LUA_OK) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        exit(1);
+    }
+    lua_pushboolean(L, isolated);
+    if (libpython) {
+        lua_pushstring(L, libpython);
+    } else {
+        lua_pushnil(L);
+    }
+    if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        exit(1);
+    }
+    return L;
+}
+
+static void* runWorker(void* arg) {
+    Worker* worker = (Worker*)arg;
+    lua_State* L = newState(worker->isolated, worker->libpython);
+    luaL_loadstring(L, run_script);
+    lua_pushinteger(L, worker->calls);
+    double start = now();
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        exit(1);
+    }
+    worker->seconds = now() - start;
+    lua_close(L);
+    return NULL;
+}
+
+static double measure(int threads, int isolated, int calls, const char* libpython) {
+    pthread_t ids[threads];
+    Worker workers[threads];
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){isolated, calls, libpython, 0};
+        pthread_create(&ids[i], NULL, runWorker, &workers[i]);
+    }
+    double slowest = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        if (workers[i].seconds > slowest) {
+            slowest = workers[i].seconds;
+        }
+    }
+    return threads * calls / slowest;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    int calls = argc > 2 ? atoi(argv[2]) : 2000;
+    const char* libpython = argc > 3 ? argv[3] : NULL;
+    // The first state starts the interpreter and hands the GIL to the workers.
+    lua_State* L = newState(0, libpython);
+    lua_getfield(L, -1, "release_gil");
+    lua_call(L, 0, 0);
+    printf("%8s %16s %16s\n", "threads", "shared calls/s", "isolated calls/s");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double shared = measure(threads, 0, calls, libpython);
+        double isolated = measure(threads, 1, calls, libpython);
+        printf("%8d %16.0f %16.0f\n", threads, shared, isolated);
+    }
+    lua_close(L);
+    return 0;
+}
@@ -0,0 +1,267 @@
+#include "luapython.h"
+
+// luapython.await(awaitable) runs Python coroutines on an asyncio event loop owned by the
+// lua_State. Inside a Lua coroutine it schedules the awaitable as a task and yields the task to
+// the caller until it is done, running one non-blocking loop iteration each time it is resumed,
+// so many tasks can be in flight from one OS thread. Outside a coroutine it simply blocks.
+// The loop itself lives in tools.getAwaitFunction.
+
+// What loop_step and loop_fd may read from the loop. asyncio only exposes its ready queue, its
+// timers and its selector as private attributes, so they are used only on the loop classes that
+// define them (asyncio.BaseEventLoop and asyncio.SelectorEventLoop), never on uvloop or other
+// third party loops.
+enum {
+    LOOP_QUEUES = 1,
+    LOOP_SELECTOR = 2
+};
+
+static int isInstancePython(PyObject* obj, PyObject* module, const char* name) {
+    PyObject* type = PyObject_GetAttrString(module, name);
+    int result = type ? PyObject_IsInstance(obj, type) : 0;
+    Py_XDECREF(type);
+    if (result < 0) {
+        PyErr_Clear();
+        result = 0;
+    }
+    return result;
+}
+
+// Returns the event loop of this lua_State (borrowed), creating it on first use.
+PyObject* getLoopPython(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    if (context->loop == NULL) {
+        PyObject* asyncio = PyImport_ImportModule("asyncio");
+        if (asyncio) {
+            context->loop = PyObject_CallMethod(asyncio, "new_event_loop", NULL);
+            if (context->loop) {
+                context->loop_flags = 0;
+                if (isInstancePython(context->loop, asyncio, "BaseEventLoop")) {
+                    context->loop_flags |= LOOP_QUEUES;
+                }
+                if (isInstancePython(context->loop, asyncio, "SelectorEventLoop")) {
+                    context->loop_flags |= LOOP_SELECTOR;
+                }
+            }
+            Py_DECREF(asyncio);
+        }
+        if (context->loop == NULL) {
+            PyErr_Print();
+            luaL_error(L, "getLoopPython: Failed to create an asyncio event loop");
+            return NULL;
+        }
+    }
+    return context->loop;
+}
+
+// Returns the thread pool of this lua_State (borrowed), creating it on first use.
+PyObject* getExecutorPython(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    if (context->executor == NULL) {
+        PyObject* futures = PyImport_ImportModule("concurrent.futures");
+        if (futures) {
+            context->executor = PyObject_CallMethod(futures, "ThreadPoolExecutor", NULL);
+            Py_DECREF(futures);
+        }
+        if (context->executor == NULL) {
+            PyErr_Print();
+            luaL_error(L, "getExecutorPython: Failed to create a thread pool");
+            return NULL;
+        }
+    }
+    return context->executor;
+}
+
+// Futures of the thread pool are wrapped so the event loop is woken when they finish.
+static int isThreadFuturePython(PythonContext* context, PyObject* obj) {
+    if (context->thread_future == NULL) {
+        PyObject* futures = PyImport_ImportModule("concurrent.futures");
+        context->thread_future = futures ? PyObject_GetAttrString(futures, "Future") : NULL;
+        Py_XDECREF(futures);
+        if (context->thread_future == NULL) {
+            PyErr_Clear();
+            return 0;
+        }
+    }
+    int result = PyObject_IsInstance(obj, context->thread_future);
+    if (result < 0) {
+        PyErr_Clear();
+        result = 0;
+    }
+    return result;
+}
+
+// Runs the ready callbacks of the loop once and polls for I/O without blocking.
+int stepLoopPython(PyObject* loop) {
+    PyObject* stop = PyObject_GetAttrString(loop, "stop");
+    if (stop == NULL) {
+        return -1;
+    }
+    PyObject* handle = PyObject_CallMethod(loop, "call_soon", "O", stop);
+    Py_DECREF(stop);
+    if (handle == NULL) {
+        return -1;
+    }
+    Py_DECREF(handle);
+    PyObject* result = PyObject_CallMethod(loop, "run_forever", NULL);
+    if (result == NULL) {
+        return -1;
+    }
+    Py_DECREF(result);
+    return 0;
+}
+
+static int isDonePython(PyObject* task) {
+    PyObject* done = PyObject_CallMethod(task, "done", NULL);
+    if (done == NULL) {
+        PyErr_Clear();
+        return 1;
+    }
+    int result = PyObject_IsTrue(done);
+    Py_DECREF(done);
+    return result;
+}
+
+// async_schedule(awaitable) -> task
+int async_schedule(lua_State* L) {
+    if (!isPythonObject(L, 1)) {
+        luaL_error(L, "python_await: Attempt to await a %s value", luaL_typename(L, 1));
+        return 0;
+    }
+    PyObject* loop = getLoopPython(L);
+    PyObject* asyncio = PyImport_ImportModule("asyncio");
+    PyObject* obj = toPythonProxy(L, 1)->obj;
+    const char* wrapper = isThreadFuturePython(getPythonContext(L), obj) ? "wrap_future" : "ensure_future";
+    PyObject* ensure = asyncio ? PyObject_GetAttrString(asyncio, wrapper) : NULL;
+    Py_XDECREF(asyncio);
+    PyObject* args = PyTuple_Pack(1, obj);
+    PyObject* kwargs = PyDict_New();
+    PyObject* task = NULL;
+    if (ensure && args && kwargs && PyDict_SetItemString(kwargs, "loop", loop) == 0) {
+        task = PyObject_Call(ensure, args, kwargs);
+    }
+    Py_XDECREF(ensure);
+    Py_XDECREF(args);
+    Py_XDECREF(kwargs);
+    if (task == NULL) {
+        PyErr_Print();
+        luaL_error(L, "python_await: Object is not awaitable");
+        return 0;
+    }
+    pushLua(L, task);
+    return 1;
+}
+
+// async_step(task) -> done
+int async_step(lua_State* L) {
+    if (!isPythonObject(L, 1)) {
+        luaL_error(L, "python_await: Task expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    PyObject* task = toPythonProxy(L, 1)->obj;
+    if (!isDonePython(task) && stepLoopPython(getLoopPython(L)) != 0) {
+        PyErr_Print();
+        luaL_error(L, "python_await: Event loop failed");
+        return 0;
+    }
+    lua_pushboolean(L, isDonePython(task));
+    return 1;
+}
+
+// async_finish(task) -> result, blocking until the task is done.
+int async_finish(lua_State* L) {
+    if (!isPythonObject(L, 1)) {
+        luaL_error(L, "python_await: Task expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    PyObject* task = toPythonProxy(L, 1)->obj;
+    PyObject* result;
+    if (isDonePython(task)) {
+        result = PyObject_CallMethod(task, "result", NULL);
+    } else {
+        result = PyObject_CallMethod(getLoopPython(L), "run_until_complete", "O", task);
+    }
+    if (result == NULL) {
+        PyErr_Print();
+        luaL_error(L, "python_await: Awaited task raised an exception");
+        return 0;
+    }
+    pushLua(L, result);
+    return 1;
+}
+
+// Seconds until the loop has to run again: 0 with callbacks ready, the delay of the earliest
+// timer otherwise, or -1 when it only waits for I/O. Other loops than asyncio's own do not expose
+// their queues, for them it is always 0 and the host keeps stepping the loop.
+static double loopTimeoutPython(PythonContext* context, PyObject* loop) {
+    if (!(context->loop_flags & LOOP_QUEUES)) {
+        return 0;
+    }
+    PyObject* ready = PyObject_GetAttrString(loop, "_ready");
+    PyObject* scheduled = PyObject_GetAttrString(loop, "_scheduled");
+    double timeout = 0;
+    if (ready == NULL || scheduled == NULL) {
+        PyErr_Clear();
+    } else if (PyObject_Length(ready) == 0) {
+        PyObject* first = PyObject_Length(scheduled) > 0 ? PySequence_GetItem(scheduled, 0) : NULL;
+        if (first == NULL) {
+            timeout = -1;
+        } else {
+            PyObject* when = PyObject_CallMethod(first, "when", NULL);
+            PyObject* now = PyObject_CallMethod(loop, "time", NULL);
+            if (when && now) {
+                timeout = PyFloat_AsDouble(when) - PyFloat_AsDouble(now);
+                timeout = timeout > 0 ? timeout : 0;
+            }
+            Py_XDECREF(when);
+            Py_XDECREF(now);
+            Py_DECREF(first);
+        }
+        if (PyErr_Occurred()) {
+            PyErr_Clear();
+            timeout = 0;
+        }
+    }
+    Py_XDECREF(ready);
+    Py_XDECREF(scheduled);
+    return timeout;
+}
+
+// luapython.loop_fd() returns a file descriptor that turns readable when the event loop has I/O
+// to process, for registering with the host's own poller (luv, cqueues, nginx ...). Only
+// selector based loops have one.
+int python_loop_fd(lua_State* L) {
+    PyObject* loop = getLoopPython(L);
+    if (!(getPythonContext(L)->loop_flags & LOOP_SELECTOR)) {
+        luaL_error(L, "python_loop_fd: The event loop is not a selector event loop");
+        return 0;
+    }
+    PyObject* selector = PyObject_GetAttrString(loop, "_selector");
+    PyObject* fd = selector ? PyObject_CallMethod(selector, "fileno", NULL) : NULL;
+    Py_XDECREF(selector);
+    if (fd == NULL) {
+        PyErr_Print();
+        luaL_error(L, "python_loop_fd: The event loop has no pollable selector");
+        return 0;
+    }
+    lua_pushinteger(L, PyLong_AsLong(fd));
+    Py_DECREF(fd);
+    return 1;
+}
+
+// luapython.loop_step() runs one non-blocking iteration of the event loop and returns how long
+// the host may sleep before calling it again, or nil to wait for loop_fd() only.
+int python_loop_step(lua_State* L) {
+    PyObject* loop = getLoopPython(L);
+    if (stepLoopPython(loop) != 0) {
+        PyErr_Print();
+        luaL_error(L, "python_loop_step: Event loop failed");
+        return 0;
+    }
+    double timeout = loopTimeoutPython(getPythonContext(L), loop);
+    if (timeout < 0) {
+        lua_pushnil(L);
+    } else {
+        lua_pushnumber(L, timeout);
+    }
+    return 1;
+}
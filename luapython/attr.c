@@ -0,0 +1,181 @@
+#include "luapython.h"
+
+#ifdef LUAPYTHON_HAS_ATTR_CACHE
+
+// Remembers where (type, name) resolved the last time so repeated dotted access skips the MRO walk.
+// Entries are only trusted while the type's version tag is unchanged; CPython assigns a new tag
+// whenever a type or one of its bases is modified, and never reuses one. Entries hold strong
+// references to the type, the name and the descriptor, and are cleared before Py_Finalize.
+#define ATTR_CACHE_SIZE 1024
+
+#define ATTR_DATA 'd'
+#define ATTR_METHOD 'm'
+#define ATTR_INSTANCE 'i'
+
+typedef struct {
+    PyTypeObject* type;
+    unsigned int version;
+    PyObject* name;
+    PyObject* descr;
+    char kind;
+} AttrEntry;
+
+static AttrEntry attr_cache[ATTR_CACHE_SIZE];
+
+// Entries are shared by the whole process, so the cache is turned off for good once a
+// sub-interpreter exists: its names and types must never meet another interpreter's.
+static int attr_cache_enabled = 1;
+
+// Offset of the instance __dict__ pointer, 0 when instances have none, or -1 when only the
+// generic lookup reads it without materializing it: managed dicts (3.11+) and variable-size objects.
+static Py_ssize_t dictOffset(PyTypeObject* type) {
+#ifdef Py_TPFLAGS_MANAGED_DICT
+    if (PyType_HasFeature(type, Py_TPFLAGS_MANAGED_DICT)) {
+        return -1;
+    }
+#endif
+    return type->tp_dictoffset < 0 ? -1 : type->tp_dictoffset;
+}
+
+// Borrowed value from the instance __dict__ at offset, or NULL.
+static PyObject* lookupInstance(PyObject* obj, PyObject* name, Py_ssize_t offset) {
+    if (offset == 0) {
+        return NULL;
+    }
+    PyObject* dict = *(PyObject**)((char*)obj + offset);
+    if (dict == NULL) {
+        return NULL;
+    }
+    return PyDict_GetItemWithError(dict, name);
+}
+
+static PyObject* bindDescriptor(PyObject* descr, PyObject* obj, PyTypeObject* type) {
+    descrgetfunc get = Py_TYPE(descr)->tp_descr_get;
+    if (get == NULL) {
+        Py_INCREF(descr);
+        return descr;
+    }
+    Py_INCREF(descr);
+    PyObject* result = get(descr, obj, (PyObject*)type);
+    Py_DECREF(descr);
+    return result;
+}
+
+// Since 3.12 modifying a type resets its tag to 0, and 3.13 no longer sets
+// Py_TPFLAGS_VALID_VERSION_TAG at all. Before that only the flag tells whether the tag is current.
+static int hasVersionTag(PyTypeObject* type) {
+#if PY_VERSION_HEX >= 0x030c0000
+    return type->tp_version_tag != 0;
+#else
+    return PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG);
+#endif
+}
+
+static PyObject* cachedGetAttr(PyObject* obj, PyObject* name) {
+    PyTypeObject* type = Py_TYPE(obj);
+    if (type->tp_getattro != PyObject_GenericGetAttr || !PyUnicode_CheckExact(name)) {
+        return PyObject_GetAttr(obj, name);
+    }
+    AttrEntry* entry = &attr_cache[(((size_t)type >> 4) ^ ((size_t)name >> 4)) % ATTR_CACHE_SIZE];
+    if (entry->type != type || entry->name != name || entry->version != type->tp_version_tag ||
+        !hasVersionTag(type)) {
+        // The lookup assigns a new tag when the type has none.
+        PyObject* descr = _PyType_Lookup(type, name);
+        if (!hasVersionTag(type)) {
+            return PyObject_GetAttr(obj, name);
+        }
+        AttrEntry old = *entry;
+        Py_INCREF(type);
+        Py_INCREF(name);
+        Py_XINCREF(descr);
+        entry->type = type;
+        entry->version = type->tp_version_tag;
+        entry->name = name;
+        entry->descr = descr;
+        if (descr == NULL) {
+            entry->kind = ATTR_INSTANCE;
+        } else if (Py_TYPE(descr)->tp_descr_set != NULL) {
+            entry->kind = ATTR_DATA;
+        } else {
+            entry->kind = ATTR_METHOD;
+        }
+        // Released last, a finalizer they run may use the cache again.
+        Py_XDECREF(old.type);
+        Py_XDECREF(old.name);
+        Py_XDECREF(old.descr);
+    }
+    PyObject* descr = entry->descr;
+    Py_ssize_t offset = dictOffset(type);
+    if (entry->kind != ATTR_DATA && offset < 0) {
+        return PyObject_GetAttr(obj, name);
+    }
+    PyObject* value;
+    switch (entry->kind) {
+    case ATTR_DATA:
+        if (Py_TYPE(descr)->tp_descr_get == NULL) {
+            return PyObject_GetAttr(obj, name);
+        }
+        return bindDescriptor(descr, obj, type);
+    case ATTR_METHOD:
+        value = lookupInstance(obj, name, offset);
+        if (value != NULL) {
+            Py_INCREF(value);
+            return value;
+        }
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        return bindDescriptor(descr, obj, type);
+    default:
+        value = lookupInstance(obj, name, offset);
+        if (value != NULL) {
+            Py_INCREF(value);
+            return value;
+        }
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        PyErr_SetObject(PyExc_AttributeError, name);
+        return NULL;
+    }
+}
+
+#endif
+
+void disableAttrCache(void) {
+#ifdef LUAPYTHON_HAS_ATTR_CACHE
+    attr_cache_enabled = 0;
+#endif
+}
+
+// Drops every entry, the GIL must be held. Called before Py_Finalize, since the entries would
+// outlive the objects they point to.
+void clearAttrCache(void) {
+#ifdef LUAPYTHON_HAS_ATTR_CACHE
+    for (int i = 0; i < ATTR_CACHE_SIZE; i++) {
+        AttrEntry old = attr_cache[i];
+        memset(&attr_cache[i], 0, sizeof(AttrEntry));
+        Py_XDECREF(old.type);
+        Py_XDECREF(old.name);
+        Py_XDECREF(old.descr);
+    }
+#endif
+}
+
+// Looks an attribute up once instead of PyObject_HasAttr followed by PyObject_GetAttr.
+// Returns a new reference, or NULL with no exception set when the attribute does not exist.
+PyObject* getAttrPython(PyObject* obj, PyObject* name) {
+#ifdef LUAPYTHON_HAS_ATTR_CACHE
+    PyObject* attr = attr_cache_enabled ? cachedGetAttr(obj, name) : PyObject_GetAttr(obj, name);
+#else
+    PyObject* attr = PyObject_GetAttr(obj, name);
+#endif
+    if (attr == NULL && PyErr_Occurred()) {
+        if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+            PyErr_Clear();
+        } else {
+            PyErr_Print();
+        }
+    }
+    return attr;
+}
@@ -0,0 +1,312 @@
+#include "luapython.h"
+
+#ifdef LUAPYTHON_HAS_BUFFER
+
+// The view is taken once when the proxy is pushed and held until the proxy is collected or
+// released by luapython.release or a scope. While it is held the object can not be resized, so
+// bytearray.extend and numpy resize raise BufferError. It lives in a capsule that releases it,
+// so the Lua collector queues the capsule with releaseLater instead of taking the GIL.
+typedef struct {
+    PythonProxy proxy;
+    Py_buffer* view;
+    PyObject* holder;
+    Py_ssize_t length;
+    char kind;
+} PythonBuffer;
+
+#define isPythonBuffer(L, index) isPythonKind(L, index, PROXY_BUFFER)
+
+// Returns the struct module code of the element type, or 0 if it can not be read natively.
+static char buffer_kind(const char* format) {
+    if (format == NULL) {
+        return 'B';
+    }
+    if (*format == '@' || *format == '=') {
+        format++;
+    }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    else if (*format == '<') {
+        format++;
+    }
+#endif
+    if (format[0] == '\0' || format[1] != '\0') {
+        return 0;
+    }
+    switch (*format) {
+    case 'b': case 'B': case 'h': case 'H': case 'i': case 'I': case 'l': case 'L':
+    case 'q': case 'Q': case 'n': case 'N': case 'f': case 'd': case '?':
+        return *format;
+    default:
+        return 0;
+    }
+}
+
+static char* buffer_item(PythonBuffer* buffer, lua_Integer index) {
+    Py_buffer* view = buffer->view;
+    if (view->ndim <= 1) {
+        Py_ssize_t stride = view->strides ? view->strides[0] : view->itemsize;
+        return (char*)view->buf + index * stride;
+    }
+    char* item = (char*)view->buf;
+    for (int dim = view->ndim - 1; dim >= 0; dim--) {
+        item += (index % view->shape[dim]) * view->strides[dim];
+        index /= view->shape[dim];
+    }
+    return item;
+}
+
+static void buffer_push_item(lua_State* L, char kind, const char* item) {
+    switch (kind) {
+    case 'b': lua_pushinteger(L, *(const signed char*)item); break;
+    case 'B': lua_pushinteger(L, *(const unsigned char*)item); break;
+    case 'h': lua_pushinteger(L, *(const short*)item); break;
+    case 'H': lua_pushinteger(L, *(const unsigned short*)item); break;
+    case 'i': lua_pushinteger(L, *(const int*)item); break;
+    case 'I': lua_pushinteger(L, *(const unsigned int*)item); break;
+    case 'l': lua_pushinteger(L, *(const long*)item); break;
+    case 'L': lua_pushinteger(L, (lua_Integer)*(const unsigned long*)item); break;
+    case 'q': lua_pushinteger(L, *(const long long*)item); break;
+    case 'Q': lua_pushinteger(L, (lua_Integer)*(const unsigned long long*)item); break;
+    case 'n': lua_pushinteger(L, *(const Py_ssize_t*)item); break;
+    case 'N': lua_pushinteger(L, (lua_Integer)*(const size_t*)item); break;
+    case 'f': lua_pushnumber(L, *(const float*)item); break;
+    case 'd': lua_pushnumber(L, *(const double*)item); break;
+    case '?': lua_pushboolean(L, *(const unsigned char*)item != 0); break;
+    }
+}
+
+static void buffer_store_item(lua_State* L, char kind, char* item, int index) {
+    if (kind == '?') {
+        *(unsigned char*)item = lua_toboolean(L, index) ? 1 : 0;
+        return;
+    }
+    if (!lua_isnumber(L, index)) {
+        luaL_error(L, "buffer_newindex: Attempt to store a %s value", luaL_typename(L, index));
+        return;
+    }
+    switch (kind) {
+    case 'f': *(float*)item = (float)lua_tonumber(L, index); return;
+    case 'd': *(double*)item = (double)lua_tonumber(L, index); return;
+    }
+#if LUA_VERSION_NUM >= 503
+    lua_Integer value = lua_isinteger(L, index) ? lua_tointeger(L, index) : (lua_Integer)lua_tonumber(L, index);
+#else
+    lua_Integer value = (lua_Integer)lua_tonumber(L, index);
+#endif
+    switch (kind) {
+    case 'b': *(signed char*)item = (signed char)value; break;
+    case 'B': *(unsigned char*)item = (unsigned char)value; break;
+    case 'h': *(short*)item = (short)value; break;
+    case 'H': *(unsigned short*)item = (unsigned short)value; break;
+    case 'i': *(int*)item = (int)value; break;
+    case 'I': *(unsigned int*)item = (unsigned int)value; break;
+    case 'l': *(long*)item = (long)value; break;
+    case 'L': *(unsigned long*)item = (unsigned long)value; break;
+    case 'q': *(long long*)item = (long long)value; break;
+    case 'Q': *(unsigned long long*)item = (unsigned long long)value; break;
+    case 'n': *(Py_ssize_t*)item = (Py_ssize_t)value; break;
+    case 'N': *(size_t*)item = (size_t)value; break;
+    }
+}
+
+static void buffer_push_sizes(lua_State* L, Py_ssize_t* sizes, int ndim) {
+    lua_createtable(L, ndim, 0);
+    for (int i = 0; i < ndim; i++) {
+        lua_pushinteger(L, sizes[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+int buffer_len(lua_State* L) {
+    if (!isPythonBuffer(L, -1)) {
+        luaL_error(L, "buffer_len: Attempt to get length of %s", luaL_typename(L, -1));
+        return 0;
+    }
+    PythonBuffer* buffer = (PythonBuffer*)lua_touserdata(L, -1);
+    lua_pushinteger(L, buffer->length);
+    return 1;
+}
+
+int buffer_index(lua_State* L) {
+    if (!isPythonBuffer(L, -2)) {
+        luaL_error(L, "buffer_index: Attempt to index %s", luaL_typename(L, -2));
+        return 0;
+    }
+    PythonBuffer* buffer = (PythonBuffer*)lua_touserdata(L, -2);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        const char* key = lua_tostring(L, -1);
+        if (strcmp(key, "shape") == 0) {
+            Py_ssize_t length = buffer->length;
+            buffer_push_sizes(L, buffer->view->ndim ? buffer->view->shape : &length, buffer->view->ndim ? buffer->view->ndim : 1);
+        } else if (strcmp(key, "strides") == 0) {
+            Py_ssize_t stride = buffer->view->itemsize;
+            buffer_push_sizes(L, buffer->view->ndim ? buffer->view->strides : &stride, buffer->view->ndim ? buffer->view->ndim : 1);
+        } else if (strcmp(key, "ndim") == 0) {
+            lua_pushinteger(L, buffer->view->ndim);
+        } else if (strcmp(key, "itemsize") == 0) {
+            lua_pushinteger(L, buffer->view->itemsize);
+        } else if (strcmp(key, "nbytes") == 0) {
+            lua_pushinteger(L, buffer->view->len);
+        } else if (strcmp(key, "format") == 0) {
+            lua_pushstring(L, buffer->view->format ? buffer->view->format : "B");
+        } else if (strcmp(key, "readonly") == 0) {
+            lua_pushboolean(L, buffer->view->readonly);
+        } else {
+            return python_index(L);
+        }
+        return 1;
+    }
+#if LUA_VERSION_NUM >= 503
+    if (!lua_isinteger(L, -1)) {
+#else
+    double num = lua_tonumber(L, -1);
+    if (!lua_isnumber(L, -1) || num != ((lua_Integer)num)) {
+#endif
+        luaL_error(L, "buffer_index: Buffer index must be an integer");
+        return 0;
+    }
+    lua_Integer idx = lua_tointeger(L, -1);
+    if (idx < 0 || idx >= buffer->length) {
+        lua_pushnil(L);
+        return 1;
+    }
+    buffer_push_item(L, buffer->kind, buffer_item(buffer, idx));
+    return 1;
+}
+
+int buffer_newindex(lua_State* L) {
+    if (!isPythonBuffer(L, -3)) {
+        luaL_error(L, "buffer_newindex: Attempt to assign to %s", luaL_typename(L, -3));
+        return 0;
+    }
+    PythonBuffer* buffer = (PythonBuffer*)lua_touserdata(L, -3);
+    if (lua_type(L, -2) == LUA_TSTRING) {
+        return python_newindex(L);
+    }
+    if (buffer->view->readonly) {
+        luaL_error(L, "buffer_newindex: Buffer is read-only");
+        return 0;
+    }
+#if LUA_VERSION_NUM >= 503
+    if (!lua_isinteger(L, -2)) {
+#else
+    double num = lua_tonumber(L, -2);
+    if (!lua_isnumber(L, -2) || num != ((lua_Integer)num)) {
+#endif
+        luaL_error(L, "buffer_newindex: Buffer index must be an integer");
+        return 0;
+    }
+    lua_Integer idx = lua_tointeger(L, -2);
+    if (idx < 0 || idx >= buffer->length) {
+        luaL_error(L, "buffer_newindex: Buffer index out of range");
+        return 0;
+    }
+    buffer_store_item(L, buffer->kind, buffer_item(buffer, idx), -1);
+    return 0;
+}
+
+// Runs without the GIL, the view and the object are released with the pending queue.
+int buffer_gc(lua_State* L) {
+    if (!isPythonProxy(L, -1) || toPythonProxy(L, -1)->kind != PROXY_BUFFER) {
+        luaL_error(L, "buffer_gc: Not a Python buffer");
+        return 0;
+    }
+    PythonBuffer* buffer = (PythonBuffer*)lua_touserdata(L, -1);
+    if (buffer->proxy.obj == NULL) {
+        return 0;
+    }
+    PythonContext* context = getPythonContext(L);
+    unaccountLua(context, &buffer->proxy);
+    releaseBufferView(context, &buffer->proxy);
+    releaseLater(context, buffer->proxy.obj);
+    buffer->proxy.obj = NULL;
+    return 0;
+}
+
+// Queues the view of a buffer proxy for release, the proxy must not be used afterwards.
+void releaseBufferView(PythonContext* context, PythonProxy* proxy) {
+    PythonBuffer* buffer = (PythonBuffer*)proxy;
+    releaseLater(context, buffer->holder);
+    buffer->holder = NULL;
+    buffer->view = NULL;
+}
+
+static void releaseHolder(PyObject* holder) {
+    Py_buffer* view = (Py_buffer*)PyCapsule_GetPointer(holder, PYTHON_BUFFER_NAME);
+    PyBuffer_Release(view);
+    PyMem_Free(view);
+}
+
+int pushBufferLua(lua_State* L, PyObject* obj) {
+    PythonContext* context = getPythonContext(L);
+    if (context->table_buffer_index != 0) {
+        if (pushCachedLua(L, obj, context->table_buffer_index)) {
+            return 1;
+        }
+        // Filled in place: exporters may point shape and strides into the Py_buffer itself.
+        Py_buffer* view = (Py_buffer*)PyMem_Malloc(sizeof(Py_buffer));
+        if (view == NULL) {
+            return pushClassLua(L, obj);
+        }
+        if (PyObject_GetBuffer(obj, view, PyBUF_RECORDS) != 0) {
+            PyErr_Clear();
+            if (PyObject_GetBuffer(obj, view, PyBUF_RECORDS_RO) != 0) {
+                PyErr_Clear();
+                PyMem_Free(view);
+                return pushClassLua(L, obj);
+            }
+        }
+        char kind = buffer_kind(view->format);
+        if (view->ndim == 0 || kind == 0 || view->suboffsets != NULL) {
+            PyBuffer_Release(view);
+            PyMem_Free(view);
+            return PyNumber_Check(obj) ? pushNumberLua(L, obj) : pushClassLua(L, obj);
+        }
+        PyObject* holder = PyCapsule_New(view, PYTHON_BUFFER_NAME, releaseHolder);
+        if (holder == NULL) {
+            PyErr_Clear();
+            PyBuffer_Release(view);
+            PyMem_Free(view);
+            return pushClassLua(L, obj);
+        }
+        Py_ssize_t length = 1;
+        for (int i = 0; i < view->ndim; i++) {
+            length *= view->shape[i];
+        }
+        PythonBuffer* buffer = (PythonBuffer*)lua_newuserdata(L, sizeof(PythonBuffer));
+        buffer->proxy.obj = obj;
+        buffer->proxy.kind = PROXY_BUFFER;
+        buffer->proxy.size = 0;
+        buffer->view = view;
+        buffer->holder = holder;
+        buffer->length = length;
+        buffer->kind = kind;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_buffer_index);
+        if (!lua_istable(L, -1)) {
+            luaL_error(L, "pushBufferLua: Internal error, buffer index is not a table");
+            return 0;
+        }
+        lua_setmetatable(L, -2);
+        cacheLua(L, obj);
+        accountLua(L, &buffer->proxy, (size_t)view->len);
+        return 1;
+    }
+    lua_createtable(L, 0, 6);
+    pushPythonFunction(L, buffer_len);
+    lua_setfield(L, -2, "__len");
+    pushPythonFunction(L, buffer_index);
+    lua_setfield(L, -2, "__index");
+    pushPythonFunction(L, buffer_newindex);
+    lua_setfield(L, -2, "__newindex");
+    pushPythonFunction(L, python_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushstring(L, PYTHON_BUFFER_NAME);
+    lua_setfield(L, -2, "__name");
+    registerProxyMetatable(L, PROXY_BUFFER);
+    context->table_buffer_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    return pushBufferLua(L, obj);
+}
+
+#endif
@@ -0,0 +1,291 @@
+#include "luapython.h"
+#include <stdatomic.h>
+
+// luapython.channel(capacity) is a bounded ring buffer that Python threads put() into and the
+// thread owning the lua_State drains in batches, so callbacks from SDK or consumer threads reach
+// Lua without a queue.Queue and a Python call per message. Producers reserve slots with a CAS on
+// the head and publish them through a per-slot sequence number (Vyukov's bounded queue); the
+// single consumer owns the tail and checks for new entries without the GIL. The tail is atomic
+// only so len() on other threads reads it whole.
+// Producers need the GIL to put(), so the owning state must call luapython.release_gil() first,
+// otherwise a loop that only polls an empty channel never lets them run.
+
+#define CHANNEL_DEFAULT_CAPACITY 1024
+
+typedef struct {
+    atomic_size_t sequence;
+    PyObject* item;
+} ChannelSlot;
+
+typedef struct {
+    PyObject_HEAD
+    size_t mask;
+    atomic_size_t head;
+    atomic_size_t tail;
+    ChannelSlot* slots;
+} PythonChannel;
+
+#define isPythonChannel(L, index) isPythonKind(L, index, PROXY_CHANNEL)
+
+// Takes a new reference to item. Returns 0 when the channel is full.
+static int channelPut(PythonChannel* channel, PyObject* item) {
+    size_t pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    ChannelSlot* slot;
+    for (;;) {
+        slot = &channel->slots[pos & channel->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
+        }
+    }
+    Py_INCREF(item);
+    slot->item = item;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return 1;
+}
+
+static int channelReady(PythonChannel* channel) {
+    size_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    ChannelSlot* slot = &channel->slots[tail & channel->mask];
+    return atomic_load_explicit(&slot->sequence, memory_order_acquire) == tail + 1;
+}
+
+// Returns the oldest item (new reference), or NULL when the channel is empty.
+static PyObject* channelTake(PythonChannel* channel) {
+    if (!channelReady(channel)) {
+        return NULL;
+    }
+    size_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    ChannelSlot* slot = &channel->slots[tail & channel->mask];
+    PyObject* item = slot->item;
+    slot->item = NULL;
+    atomic_store_explicit(&slot->sequence, tail + channel->mask + 1, memory_order_release);
+    atomic_store_explicit(&channel->tail, tail + 1, memory_order_release);
+    return item;
+}
+
+static PyObject* channel_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"capacity", NULL};
+    Py_ssize_t capacity = CHANNEL_DEFAULT_CAPACITY;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n:channel", keywords, &capacity)) {
+        return NULL;
+    }
+    if (capacity < 1) {
+        PyErr_SetString(PyExc_ValueError, "channel capacity must be positive");
+        return NULL;
+    }
+    // Rounding up to a power of two must neither overflow nor wrap the slot array size.
+    if ((size_t)capacity > (size_t)PY_SSIZE_T_MAX / sizeof(ChannelSlot) / 2) {
+        PyErr_SetString(PyExc_ValueError, "channel capacity is too large");
+        return NULL;
+    }
+    size_t size = 1;
+    while (size < (size_t)capacity) {
+        size <<= 1;
+    }
+    allocfunc alloc = (allocfunc)PyType_GetSlot(type, Py_tp_alloc);
+    PythonChannel* channel = (PythonChannel*)alloc(type, 0);
+    if (channel == NULL) {
+        return NULL;
+    }
+    channel->slots = (ChannelSlot*)PyMem_Malloc(sizeof(ChannelSlot) * size);
+    if (channel->slots == NULL) {
+        Py_DECREF(channel);
+        return PyErr_NoMemory();
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&channel->slots[i].sequence, i);
+        channel->slots[i].item = NULL;
+    }
+    channel->mask = size - 1;
+    atomic_init(&channel->head, 0);
+    atomic_init(&channel->tail, 0);
+    return (PyObject*)channel;
+}
+
+static void channel_dealloc(PyObject* self) {
+    PythonChannel* channel = (PythonChannel*)self;
+    PyTypeObject* type = Py_TYPE(self);
+    if (channel->slots) {
+        PyObject* item;
+        while ((item = channelTake(channel)) != NULL) {
+            Py_DECREF(item);
+        }
+        PyMem_Free(channel->slots);
+    }
+    freefunc tp_free = (freefunc)PyType_GetSlot(type, Py_tp_free);
+    tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject* channel_put(PyObject* self, PyObject* item) {
+    return PyBool_FromLong(channelPut((PythonChannel*)self, item));
+}
+
+static Py_ssize_t channel_len(PyObject* self) {
+    PythonChannel* channel = (PythonChannel*)self;
+    // The tail is read first, so it never passes the head read after it.
+    size_t tail = atomic_load_explicit(&channel->tail, memory_order_acquire);
+    return (Py_ssize_t)(atomic_load_explicit(&channel->head, memory_order_acquire) - tail);
+}
+
+static PyMethodDef channel_methods[] = {
+    {"put", channel_put, METH_O, "put(item) -> bool, False when the channel is full"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyType_Slot channel_slots[] = {
+    {Py_tp_new, channel_new},
+    {Py_tp_dealloc, channel_dealloc},
+    {Py_tp_methods, channel_methods},
+    {Py_sq_length, channel_len},
+    {Py_tp_doc, "Bounded channel from Python threads to a Lua state"},
+    {0, NULL}
+};
+
+static PyType_Spec channel_spec = {
+    "luapython.channel",
+    sizeof(PythonChannel),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    channel_slots
+};
+
+// The type is created per interpreter, so isolated states never share it.
+static PyObject* getChannelTypePython(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    if (context->channel_type == NULL) {
+        context->channel_type = PyType_FromSpec(&channel_spec);
+        if (context->channel_type == NULL) {
+            PyErr_Print();
+            luaL_error(L, "getChannelTypePython: Failed to create the channel type");
+            return NULL;
+        }
+    }
+    return context->channel_type;
+}
+
+// channel:drain(max[, buffer]) -> buffer, count with up to max items in order. Reusing buffer
+// saves a table per poll; entries after count are cleared.
+int channel_drain_python(lua_State* L) {
+    PythonChannel* channel = (PythonChannel*)toPythonProxy(L, 1)->obj;
+    lua_Integer max = luaL_optinteger(L, 2, 0x7fffffff);
+    lua_Integer count = 0;
+    PyObject* item;
+    while (count < max && (item = channelTake(channel)) != NULL) {
+        pushLua(L, item);
+        lua_rawseti(L, 3, ++count);
+    }
+    lua_pushnil(L);
+    lua_rawseti(L, 3, count + 1);
+    lua_settop(L, 3);
+    lua_pushinteger(L, count);
+    return 2;
+}
+
+// Polling an empty channel neither takes the GIL nor converts anything.
+int channel_drain(lua_State* L) {
+    if (!isPythonChannel(L, 1)) {
+        luaL_error(L, "channel_drain: Python channel expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    lua_settop(L, 3);
+    if (lua_isnil(L, 3)) {
+        lua_newtable(L);
+        lua_replace(L, 3);
+    }
+    luaL_checktype(L, 3, LUA_TTABLE);
+    if (!channelReady((PythonChannel*)toPythonProxy(L, 1)->obj)) {
+        lua_pushnil(L);
+        lua_rawseti(L, 3, 1);
+        lua_pushinteger(L, 0);
+        return 2;
+    }
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, 3, 2);
+    return 2;
+}
+
+int channel_put_lua(lua_State* L) {
+    if (!isPythonChannel(L, 1)) {
+        luaL_error(L, "channel_put: Python channel expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    PyObject* item = convertPython(L, 2);
+    if (item == NULL) {
+        luaL_error(L, "channel_put: Failed to convert the item");
+        return 0;
+    }
+    int result = channelPut((PythonChannel*)toPythonProxy(L, 1)->obj, item);
+    Py_DECREF(item);
+    lua_pushboolean(L, result);
+    return 1;
+}
+
+int channel_len_lua(lua_State* L) {
+    if (!isPythonChannel(L, 1)) {
+        luaL_error(L, "channel_len: Python channel expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    lua_pushinteger(L, channel_len(toPythonProxy(L, 1)->obj));
+    return 1;
+}
+
+// luapython.channel([capacity]) creates a channel, luapython.channel(obj) wraps again a channel
+// that was handed to Python and came back as a plain object.
+int python_channel(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    PyObject* type = getChannelTypePython(L);
+    PyObject* channel;
+    if (isPythonObject(L, 1)) {
+        channel = toPythonProxy(L, 1)->obj;
+        if (!PyObject_TypeCheck(channel, (PyTypeObject*)type)) {
+            luaL_error(L, "python_channel: Python channel expected, got %s", getPythonTypeName(channel));
+            return 0;
+        }
+        Py_INCREF(channel);
+    } else {
+        channel = PyObject_CallFunction(type, "n", (Py_ssize_t)luaL_optinteger(L, 1, CHANNEL_DEFAULT_CAPACITY));
+        if (channel == NULL) {
+            PyErr_Print();
+            luaL_error(L, "python_channel: Failed to create a channel");
+            return 0;
+        }
+    }
+    if (context->table_channel_index == 0) {
+        lua_createtable(L, 0, 5);
+        lua_createtable(L, 0, 2);
+        pushPythonFunction(L, channel_drain_python);
+        lua_pushcclosure(L, channel_drain, 1);
+        lua_setfield(L, -2, "drain");
+        pushPythonFunction(L, channel_put_lua);
+        lua_setfield(L, -2, "put");
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, channel_len_lua);
+        lua_setfield(L, -2, "__len");
+        pushPythonFunction(L, python_tostring);
+        lua_setfield(L, -2, "__tostring");
+        lua_pushcfunction(L, python_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushstring(L, PYTHON_CHANNEL_NAME);
+        lua_setfield(L, -2, "__name");
+        registerProxyMetatable(L, PROXY_CHANNEL);
+        context->table_channel_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+    proxy->obj = channel;
+    proxy->kind = PROXY_CHANNEL;
+    proxy->size = 0;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_channel_index);
+    lua_setmetatable(L, -2);
+    return 1;
+}
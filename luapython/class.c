@@ -5,48 +5,57 @@ int class_index(lua_State* L) {
         luaL_error(L, "class_index: Attempt to index a %s value", luaL_typename(L, -2));
         return 0;
     }
-    const char* key = lua_tostring(L, -1);
     if (!isPythonObject(L, -2)) {
         luaL_error(L, "class_index: Not a Python object");
         return 0;
     }
-    PyObject* obj = *(PyObject**)lua_touserdata(L, -2);
-    Py_XINCREF(obj);
-    if (!PyObject_HasAttrString(obj, lua_tostring(L, -1))) {
+    PyObject* key = lua_type(L, -1) == LUA_TSTRING ? internStringPython(L, -1) : convertStringPython(L, -1);
+    if (key == NULL) {
+        PyErr_Clear();
         lua_pushnil(L);
         return 1;
     }
-    PyObject* attr = PyObject_GetAttrString(obj, key);
+    PyObject* obj = *(PyObject**)lua_touserdata(L, -2);
+    Py_XINCREF(obj);
+    PyObject* attr = getAttrPython(obj, key);
+    Py_XDECREF(key);
     Py_DECREF(obj);
     pushLua(L, attr);
     return 1;
 }
 
-int table_class_index = 0;
-
 int pushClassLua(lua_State* L, PyObject* obj) {
-    if (table_class_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = obj;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_class_index);
+    PythonContext* context = getPythonContext(L);
+    if (context->table_class_index != 0) {
+        if (pushCachedLua(L, obj, context->table_class_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = obj;
+        proxy->kind = PROXY_CLASS;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_class_index);
         if (!lua_istable(L, -1)) {
             luaL_error(L, "pushClassLua: Internal error, class index is not a table");
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, obj);
+        accountLua(L, proxy, sizeOfPython(context, obj));
         return 1;
     }
     lua_createtable(L, 0, 5);
-    lua_pushcfunction(L, class_index);
+    pushPythonFunction(L, class_index);
     lua_setfield(L, -2, "__index");
-    lua_pushcfunction(L, python_newindex);
+    pushPythonFunction(L, python_newindex);
     lua_setfield(L, -2, "__newindex");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
     lua_pushstring(L, PYTHON_CLASS_NAME);
     lua_setfield(L, -2, "__name");
-    lua_pushcfunction(L, python_tostring);
+    pushPythonFunction(L, python_tostring);
     lua_setfield(L, -2, "__tostring");
-    table_class_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_CLASS);
+    context->table_class_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushClassLua(L, obj);
 }
\ No newline at end of file
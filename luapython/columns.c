@@ -0,0 +1,296 @@
+#include "luapython.h"
+
+// luapython.columns(records, {fields=, dtypes=}) turns a Lua array of records into a dict of
+// columns in one walk over the array, for pandas.DataFrame and friends, instead of a dict per
+// row. Fields with a numeric dtype are written straight into one bytearray each, which is then
+// wrapped by numpy.frombuffer without a copy (array.array when numpy is missing). Other fields
+// become lists.
+
+typedef struct {
+    const char* name;
+    char code;
+    int size;
+    const char* numpy;
+} ColumnType;
+
+static const ColumnType column_types[] = {
+    {"float64", 'd', 8, "float64"},
+    {"float32", 'f', 4, "float32"},
+    {"int64", 'q', 8, "int64"},
+    {"int32", 'i', 4, "int32"},
+    {"bool", '?', 1, "bool"},
+    {NULL, 0, 0, NULL}
+};
+
+typedef struct {
+    PyObject* column;
+    char* data;
+    const ColumnType* type;
+} Column;
+
+static const ColumnType* columnType(lua_State* L, int index) {
+    if (lua_isnil(L, index)) {
+        return NULL;
+    }
+    const char* name = lua_tostring(L, index);
+    if (name == NULL) {
+        luaL_error(L, "python_columns: dtype must be a string, got %s", luaL_typename(L, index));
+        return NULL;
+    }
+    if (strcmp(name, "object") == 0) {
+        return NULL;
+    }
+    for (const ColumnType* type = column_types; type->name; type++) {
+        if (strcmp(type->name, name) == 0) {
+            return type;
+        }
+    }
+    luaL_error(L, "python_columns: Unknown dtype %s", name);
+    return NULL;
+}
+
+// Pushes the field names: the fields option, or the sorted string keys of the first record.
+static void pushFieldsLua(lua_State* L, int records, int options) {
+    if (lua_istable(L, options)) {
+        lua_getfield(L, options, "fields");
+        if (lua_istable(L, -1)) {
+            return;
+        }
+        if (!lua_isnil(L, -1)) {
+            luaL_error(L, "python_columns: fields must be a list of names");
+            return;
+        }
+        lua_pop(L, 1);
+    }
+    lua_newtable(L);
+    lua_rawgeti(L, records, 1);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_Integer count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -4, ++count);
+        }
+    }
+    lua_pop(L, 1);
+    lua_getglobal(L, "table");
+    lua_getfield(L, -1, "sort");
+    lua_remove(L, -2);
+    if (lua_isfunction(L, -1)) {
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 0);
+    } else {
+        lua_pop(L, 1);
+    }
+}
+
+// Stores the value on top of the stack into row i of a typed column. Returns 0 on a mismatch.
+static int storeColumn(lua_State* L, Column* column, lua_Integer i) {
+    char* slot = column->data + column->type->size * i;
+    int type = lua_type(L, -1);
+    switch (column->type->code) {
+    case 'd':
+    case 'f': {
+        double value;
+        if (type == LUA_TNUMBER) {
+            value = (double)lua_tonumber(L, -1);
+        } else if (type == LUA_TNIL) {
+            value = Py_NAN;
+        } else {
+            return 0;
+        }
+        if (column->type->code == 'd') {
+            memcpy(slot, &value, sizeof(double));
+        } else {
+            float single = (float)value;
+            memcpy(slot, &single, sizeof(float));
+        }
+        return 1;
+    }
+    case 'q':
+    case 'i': {
+        if (type != LUA_TNUMBER) {
+            return 0;
+        }
+        long long value;
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, -1)) {
+            value = (long long)lua_tointeger(L, -1);
+        } else
+#endif
+        {
+            lua_Number number = lua_tonumber(L, -1);
+            value = (long long)number;
+            if ((lua_Number)value != number) {
+                return 0;
+            }
+        }
+        if (column->type->code == 'q') {
+            memcpy(slot, &value, sizeof(long long));
+        } else {
+            if (value < INT_MIN || value > INT_MAX) {
+                return 0;
+            }
+            int small = (int)value;
+            memcpy(slot, &small, sizeof(int));
+        }
+        return 1;
+    }
+    default:
+        *slot = (char)lua_toboolean(L, -1);
+        return 1;
+    }
+}
+
+// Wraps the bytearray of a typed column, numpy.frombuffer shares its memory.
+static PyObject* wrapColumn(PyObject* numpy, Column* column) {
+    if (numpy) {
+        return PyObject_CallMethod(numpy, "frombuffer", "Os", column->column, column->type->numpy);
+    }
+    PyObject* array = PyImport_ImportModule("array");
+    if (array == NULL) {
+        return NULL;
+    }
+    char code[2] = {column->type->code == '?' ? 'b' : column->type->code, 0};
+    PyObject* result = PyObject_CallMethod(array, "array", "sO", code, column->column);
+    Py_DECREF(array);
+    return result;
+}
+
+int python_columns(lua_State* L) {
+    if (!lua_istable(L, 1)) {
+        luaL_error(L, "python_columns: Array of records expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    if (!lua_isnoneornil(L, 2) && !lua_istable(L, 2)) {
+        luaL_error(L, "python_columns: Options table expected, got %s", luaL_typename(L, 2));
+        return 0;
+    }
+    lua_settop(L, 2);
+    pushFieldsLua(L, 1, 2);
+#if LUA_VERSION_NUM >= 502
+    lua_Integer rows = (lua_Integer)lua_rawlen(L, 1);
+    int count = (int)lua_rawlen(L, 3);
+#else
+    lua_Integer rows = (lua_Integer)lua_objlen(L, 1);
+    int count = (int)lua_objlen(L, 3);
+#endif
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "dtypes");
+    } else {
+        lua_pushnil(L);
+    }
+    Column* columns = (Column*)lua_newuserdata(L, sizeof(Column) * (count > 0 ? count : 1));
+    PyObject* result = PyDict_New();
+    if (result == NULL) {
+        PyErr_Print();
+        luaL_error(L, "python_columns: Failed to create the result");
+        return 0;
+    }
+    for (int f = 0; f < count; f++) {
+        lua_rawgeti(L, 3, f + 1);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            Py_DECREF(result);
+            luaL_error(L, "python_columns: Field name must be a string, got %s", luaL_typename(L, -1));
+            return 0;
+        }
+        columns[f].type = NULL;
+        if (lua_istable(L, 4)) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, 4);
+            columns[f].type = columnType(L, -1);
+            lua_pop(L, 1);
+        }
+        if (columns[f].type) {
+            columns[f].column = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)(rows * columns[f].type->size));
+            columns[f].data = columns[f].column ? PyByteArray_AsString(columns[f].column) : NULL;
+        } else {
+            columns[f].column = PyList_New((Py_ssize_t)rows);
+            columns[f].data = NULL;
+        }
+        PyObject* key = internStringPython(L, -1);
+        // A second column of the same name would replace the first while it is still written.
+        if (key && PyDict_Contains(result, key) == 1) {
+            Py_DECREF(key);
+            Py_XDECREF(columns[f].column);
+            Py_DECREF(result);
+            luaL_error(L, "python_columns: Duplicate field %s", lua_tostring(L, -1));
+            return 0;
+        }
+        lua_pop(L, 1);
+        if (columns[f].column == NULL || key == NULL || PyDict_SetItem(result, key, columns[f].column) != 0) {
+            Py_XDECREF(key);
+            Py_XDECREF(columns[f].column);
+            Py_DECREF(result);
+            PyErr_Print();
+            luaL_error(L, "python_columns: Failed to create a column");
+            return 0;
+        }
+        Py_DECREF(key);
+        // The result keeps the column alive, so errors below only release the result.
+        Py_DECREF(columns[f].column);
+    }
+    for (lua_Integer i = 0; i < rows; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        if (!lua_istable(L, -1)) {
+            Py_DECREF(result);
+            luaL_error(L, "python_columns: Record %d is a %s value", (int)(i + 1), luaL_typename(L, -1));
+            return 0;
+        }
+        for (int f = 0; f < count; f++) {
+            lua_rawgeti(L, 3, f + 1);
+            lua_rawget(L, -2);
+            if (columns[f].data) {
+                if (!storeColumn(L, &columns[f], i)) {
+                    Py_DECREF(result);
+                    lua_rawgeti(L, 3, f + 1);
+                    luaL_error(L, "python_columns: Field %s of record %d is not a %s", lua_tostring(L, -1),
+                               (int)(i + 1), columns[f].type->name);
+                    return 0;
+                }
+            } else {
+                PyObject* value = convertPython(L, -1);
+                if (value == NULL) {
+                    Py_DECREF(result);
+                    luaL_error(L, "python_columns: Failed to convert record %d", (int)(i + 1));
+                    return 0;
+                }
+                PyList_SetItem(columns[f].column, (Py_ssize_t)i, value);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    PyObject* numpy = PyImport_ImportModule("numpy");
+    if (numpy == NULL) {
+        PyErr_Clear();
+    }
+    for (int f = 0; f < count; f++) {
+        if (columns[f].data == NULL) {
+            continue;
+        }
+        PyObject* wrapped = wrapColumn(numpy, &columns[f]);
+        lua_rawgeti(L, 3, f + 1);
+        PyObject* key = internStringPython(L, -1);
+        lua_pop(L, 1);
+        if (wrapped == NULL || key == NULL || PyDict_SetItem(result, key, wrapped) != 0) {
+            Py_XDECREF(wrapped);
+            Py_XDECREF(key);
+            Py_XDECREF(numpy);
+            Py_DECREF(result);
+            PyErr_Print();
+            luaL_error(L, "python_columns: Failed to wrap a typed column");
+            return 0;
+        }
+        Py_DECREF(wrapped);
+        Py_DECREF(key);
+    }
+    Py_XDECREF(numpy);
+    pushLua(L, result);
+    return 1;
+}
@@ -166,7 +166,7 @@ CXX ?= gcc
 CXXFLAGS = -shared -fPIC -g -I$(PREFIX)/include/lua$(LUA_VERSION) $(shell python3-config --includes) -DPREFIX="\"$(PREFIX)\"" -DPYTHON_LIB="\"libpython3.so\""
 LDFLAGS += -lm -ldl
 
-SOURCES = luapython.c number.c string.c set.c dict.c list.c tuple.c module.c function.c class.c tools.c iter.c
+SOURCES = luapython.c number.c string.c set.c dict.c list.c tuple.c module.c function.c class.c tools.c iter.c buffer.c intern.c attr.c gil.c context.c async.c pmap.c channel.c memory.c scope.c schema.c columns.c
 OBJECTS = $(SOURCES:.c=.o)
 
 TARGET = luapython.so
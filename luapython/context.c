@@ -0,0 +1,77 @@
+#include "luapython.h"
+
+static const char context_key = 0;
+
+// Drops the Python objects owned by the context. Needs the GIL of the state's interpreter.
+void releaseContextPython(PythonContext* context) {
+    releasePending(context);
+    clearConvertCache(context);
+    clearSizeCache(context);
+    Py_CLEAR(context->numbers_number);
+    Py_CLEAR(context->channel_type);
+    Py_CLEAR(context->thread_future);
+    if (context->loop) {
+        PyObject* result = PyObject_CallMethod(context->loop, "close", NULL);
+        if (result == NULL) {
+            PyErr_Clear();
+        }
+        Py_XDECREF(result);
+        Py_CLEAR(context->loop);
+    }
+    if (context->executor) {
+        // Returns without waiting, calls already submitted still run on the workers.
+        PyObject* result = PyObject_CallMethod(context->executor, "shutdown", "O", Py_False);
+        if (result == NULL) {
+            PyErr_Clear();
+        }
+        Py_XDECREF(result);
+        Py_CLEAR(context->executor);
+    }
+}
+
+// Runs after the proxies of the state were collected, since the context is created first.
+static int context_gc(lua_State* L) {
+    PythonContext* context = (PythonContext*)lua_touserdata(L, 1);
+    if (Py_IsInitialized()) {
+#ifdef LUAPYTHON_HAS_SUBINTERPRETERS
+        if (context->interpreter) {
+            stopInterpreter(context);
+        } else
+#endif
+        {
+            PyGILState_STATE state = PyGILState_Ensure();
+            releaseContextPython(context);
+            PyGILState_Release(state);
+        }
+    }
+    free(context->pending);
+    context->pending = NULL;
+    return 0;
+}
+
+// Returns the binding data of this lua_State, creating it on first use. Coroutines share the
+// registry of their main state and so share its context.
+PythonContext* getPythonContext(lua_State* L) {
+    lua_pushlightuserdata(L, (void*)&context_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    PythonContext* context = (PythonContext*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (context) {
+        return context;
+    }
+    context = (PythonContext*)lua_newuserdata(L, sizeof(PythonContext));
+    memset(context, 0, sizeof(PythonContext));
+    context->tools_release_to_env = LUA_REFNIL;
+    context->tools_get_iter_function = LUA_REFNIL;
+    context->tools_get_await_function = LUA_REFNIL;
+    context->gc_min_size = 64 * 1024;
+    context->gc_pressure = 1;
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, context_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, (void*)&context_key);
+    lua_insert(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    return context;
+}
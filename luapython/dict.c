@@ -1,6 +1,6 @@
 #include "luapython.h"
 
-#define isPythonDict(L, index) (isPythonObject(L, index) && PyDict_Check(*(PyObject**)lua_touserdata(L, index)))
+#define isPythonDict(L, index) isPythonKind(L, index, PROXY_DICT)
 
 int dict_len(lua_State* L) {
     if (!(lua_istable(L, -1) || isPythonDict(L, -1))) {
@@ -30,19 +30,28 @@ int dict_index(lua_State* L) {
     }
     PyObject* py_dict = *(PyObject**)lua_touserdata(L, -2);
     Py_XINCREF(py_dict);
-    PyObject* py_key = convertPython(L, -1);
+    PyObject* py_key = lua_type(L, -1) == LUA_TSTRING ? internStringPython(L, -1) : convertPython(L, -1);
     if (!py_key) {
+        Py_XDECREF(py_dict);
+        PyErr_Clear();
         luaL_error(L, "dict_index: Invalid key type for dictionary access");
         return 0;
     }
+#ifdef LUAPYTHON_HAS_ITEM_REF
+    PyObject* py_value = NULL;
+    if (PyDict_GetItemRef(py_dict, py_key, &py_value) < 0) {
+        PyErr_Clear();
+    }
+#else
     PyObject* py_value = PyDict_GetItem(py_dict, py_key);
+    Py_XINCREF(py_value);
+#endif
     Py_XDECREF(py_dict);
     Py_XDECREF(py_key);
     if (!py_value) {
         lua_pushnil(L);
         return 1;
     }
-    Py_XINCREF(py_value);
     pushLua(L, py_value);
     return 1;
 }
@@ -54,7 +63,7 @@ int dict_newindex(lua_State* L) {
     }
     PyObject* py_dict = *(PyObject**)lua_touserdata(L, -3);
     Py_XINCREF(py_dict);
-    PyObject* py_key = convertPython(L, -2);
+    PyObject* py_key = lua_type(L, -2) == LUA_TSTRING ? internStringPython(L, -2) : convertPython(L, -2);
     PyObject* py_value = convertPython(L, -1);
     if (!py_key || !py_value) {
         Py_XDECREF(py_dict);
@@ -62,6 +71,7 @@ int dict_newindex(lua_State* L) {
             Py_XDECREF(py_key);
         if (py_value)
             Py_XDECREF(py_value);
+        PyErr_Clear();
         luaL_error(L, "dict_newindex: Invalid key or value type for dictionary assignment");
         return 0;
     }
@@ -110,11 +120,7 @@ int dict_add(lua_State* L) {
         luaL_error(L, "dict_add: Failed to copy dictionary");
         return 0;
     }
-    PyObject *key, *value;
-    Py_ssize_t pos = 0;
-    while (PyDict_Next(py_dict2, &pos, &key, &value)) {
-        PyDict_SetItem(result, key, value);
-    }
+    PyDict_Update(result, py_dict2);
     Py_XDECREF(py_dict1);
     Py_XDECREF(py_dict2);
     pushDictLua(L, result);
@@ -158,11 +164,13 @@ int dict_mul(lua_State* L) {
     }
     PyObject *key, *value;
     Py_ssize_t pos = 0;
+    LUAPYTHON_BEGIN_CRITICAL_SECTION2(py_dict1, py_dict2);
     while (PyDict_Next(py_dict1, &pos, &key, &value)) {
         if (PyDict_Contains(py_dict2, key)) {
             PyDict_SetItem(result, key, value);
         }
     }
+    LUAPYTHON_END_CRITICAL_SECTION2();
     Py_XDECREF(py_dict1);
     Py_XDECREF(py_dict2);
     pushDictLua(L, result);
@@ -206,55 +214,64 @@ int dict_sub(lua_State* L) {
     }
     PyObject *key, *value;
     Py_ssize_t pos = 0;
+    LUAPYTHON_BEGIN_CRITICAL_SECTION2(py_dict1, py_dict2);
     while (PyDict_Next(py_dict1, &pos, &key, &value)) {
         if (!PyDict_Contains(py_dict2, key)) {
             PyDict_SetItem(result, key, value);
         }
     }
+    LUAPYTHON_END_CRITICAL_SECTION2();
     Py_XDECREF(py_dict1);
     Py_XDECREF(py_dict2);
     pushDictLua(L, result);
     return 1;
 }
 
-int table_dict_index = 0;
-
 int pushDictLua(lua_State* L, PyObject* obj) {
+    PythonContext* context = getPythonContext(L);
     if (!PyDict_Check(obj)) {
         luaL_error(L, "pushDictLua: Not a dict");
         return 0;
     }
-    if (table_dict_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = obj;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_dict_index);
+    if (context->table_dict_index != 0) {
+        if (pushCachedLua(L, obj, context->table_dict_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = obj;
+        proxy->kind = PROXY_DICT;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_dict_index);
         if (!lua_istable(L, -1)) {
             luaL_error(L, "pushDictLua: Internal error, class index is not a table");
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, obj);
+        accountLua(L, proxy, sizeOfPython(context, obj));
         return 1;
     }
     lua_createtable(L, 0, 9);
-    lua_pushcfunction(L, dict_len);
+    pushPythonFunction(L, dict_len);
     lua_setfield(L, -2, "__len");
-    lua_pushcfunction(L, dict_add);
+    pushPythonFunction(L, dict_add);
     lua_setfield(L, -2, "__add");
-    lua_pushcfunction(L, dict_mul);
+    pushPythonFunction(L, dict_mul);
     lua_setfield(L, -2, "__mul");
-    lua_pushcfunction(L, dict_sub);
+    pushPythonFunction(L, dict_sub);
     lua_setfield(L, -2, "__sub");
-    lua_pushcfunction(L, dict_index);
+    pushPythonFunction(L, dict_index);
     lua_setfield(L, -2, "__index");
-    lua_pushcfunction(L, dict_newindex);
+    pushPythonFunction(L, dict_newindex);
     lua_setfield(L, -2, "__newindex");
-    lua_pushcfunction(L, python_tostring);
+    pushPythonFunction(L, python_tostring);
     lua_setfield(L, -2, "__tostring");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
     lua_pushstring(L, PYTHON_DICT_NAME);
     lua_setfield(L, -2, "__name");
-    table_dict_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_DICT);
+    context->table_dict_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushDictLua(L, obj);
 }
 
@@ -266,8 +283,7 @@ PyObject* convertDictPython(lua_State* L, int index) {
         while (lua_next(L, -2) != 0) {
             if (lua_isstring(L, -2)) {
                 lua_pushvalue(L, -2);
-                const char* key = lua_tostring(L, -1);
-                PyObject* py_key = PyUnicode_FromString(key);
+                PyObject* py_key = internStringPython(L, -1);
                 PyObject* py_value = convertPython(L, -2);
                 lua_pop(L, 1);
                 if (py_key && py_value) {
@@ -1,60 +1,47 @@
 #include "luapython.h"
 
-#define isPythonFunction(L, index) (isPythonObject(L, index) && PyCallable_Check(*(PyObject**)lua_touserdata(L, index)))
+#define isPythonFunction(L, index) isPythonKind(L, index, PROXY_FUNCTION)
 
-int function_call(lua_State* L) {
-    if (!lua_isnumber(L, -1)) {
-        luaL_error(L, "function_call: The last argument must be the number of arguments");
-        return 0;
-    }
-    int nargs = lua_tonumber(L, -1);
-    if (!isPythonFunction(L, -4)) {
-        luaL_error(L, "function_call: Attempt to call a %s object", luaL_typename(L, -3));
-        return 0;
-    }
-    PyObject* function = *(PyObject**)lua_touserdata(L, -4);
-    Py_XINCREF(function);
-    if (!PyCallable_Check(function)) {
-        Py_XDECREF(function);
-        luaL_error(L, "function_call: Attempt to call a %s object", getPythonTypeName(function));
-        return 0;
-    }
-    PyObject* args = PyTuple_New(nargs);
-    PyObject* kwargs = PyDict_New();
-    for(int i = 1; i <= nargs; i++){
-#if LUA_VERSION_NUM >= 503
-        lua_geti(L, -3, i);
+// Arguments up to this count are passed from a C stack array, larger calls borrow a userdata.
+#define FUNCTION_STACK_ARGS 8
+
+// args[-1] must be writable: vectorcall may borrow that slot to prepend a bound self.
+static PyObject* callPython(PyObject* function, PyObject** args, Py_ssize_t nargs, PyObject* kwnames) {
+#ifdef LUAPYTHON_HAS_VECTORCALL
+    return PyObject_Vectorcall(function, args, nargs | PY_VECTORCALL_ARGUMENTS_OFFSET, kwnames);
 #else
-        lua_pushnumber(L, i);
-        lua_gettable(L, -4);
-#endif
-        PyObject* arg = convertPython(L, -1);
-        if (!arg) {
-            Py_XDECREF(args);
-            Py_XDECREF(kwargs);
-            Py_XDECREF(function);
-            luaL_error(L, "function_call: Failed to convert argument %d", i);
-            return 0;
-        }
-        PyTuple_SetItem(args, i-1, arg);
-        lua_pop(L, 1);
+    PyObject* tuple = PyTuple_New(nargs);
+    if (!tuple) {
+        return NULL;
     }
-    lua_pushnil(L);
-    while (lua_next(L, -3) != 0) {
-        if (lua_type(L, -2) == LUA_TSTRING) {
-            const char* key = lua_tostring(L, -2);
-            PyObject* key_py = PyUnicode_FromString(key);
-            PyObject* value = convertPython(L, -1);
-            PyDict_SetItem(kwargs, key_py, value);
-            Py_XDECREF(key_py);
-            Py_XDECREF(value);
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        Py_XINCREF(args[i]);
+        PyTuple_SetItem(tuple, i, args[i]);
+    }
+    PyObject* kwargs = NULL;
+    if (kwnames) {
+        kwargs = PyDict_New();
+        Py_ssize_t nkwargs = PyTuple_Size(kwnames);
+        for (Py_ssize_t i = 0; i < nkwargs; i++) {
+            PyDict_SetItem(kwargs, PyTuple_GetItem(kwnames, i), args[nargs + i]);
         }
-        lua_pop(L, 1);
     }
-    PyObject* result = PyObject_Call(function, args, kwargs);
-    Py_XDECREF(args);
+    PyObject* result = PyObject_Call(function, tuple, kwargs);
+    Py_XDECREF(tuple);
     Py_XDECREF(kwargs);
-    Py_XDECREF(function);
+    return result;
+#endif
+}
+
+static PyObject** allocArgs(lua_State* L, PyObject** stack, int count) {
+    if (count < FUNCTION_STACK_ARGS) {
+        return stack + 1;
+    }
+    PyObject** args = (PyObject**)lua_newuserdata(L, sizeof(PyObject*) * (count + 1));
+    return args + 1;
+}
+
+static int pushCallResult(lua_State* L, PyObject* result) {
     if (PyErr_Occurred()) {
         PyErr_Print();
         Py_XDECREF(result);
@@ -75,42 +62,427 @@ int function_call(lua_State* L) {
     return 1;
 }
 
-int table_function_index = 0;
+// luapython.kw{...} tags a table so it is always passed as keyword arguments.
+int python_kw(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    if (!lua_istable(L, 1)) {
+        luaL_error(L, "python_kw: Attempt to use a %s value as keyword arguments", luaL_typename(L, 1));
+        return 0;
+    }
+    if (context->table_kwargs_index == 0) {
+        lua_createtable(L, 0, 1);
+        lua_pushstring(L, LUAPYTHON_KWARGS_NAME);
+        lua_setfield(L, -2, "__name");
+        context->table_kwargs_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_settop(L, 1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_kwargs_index);
+    lua_setmetatable(L, 1);
+    return 1;
+}
+
+// A trailing table is taken as keyword arguments when tagged by luapython.kw, or when it is a
+// plain table with at least one string key and no number keys. Tables with array items are
+// rejected by their length, so large positional lists are never scanned.
+static int isKeywordTable(lua_State* L, int index) {
+    PythonContext* context = getPythonContext(L);
+    if (!lua_istable(L, index)) {
+        return 0;
+    }
+    if (lua_getmetatable(L, index)) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_kwargs_index);
+        int result = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        return result;
+    }
+#if LUA_VERSION_NUM >= 502
+    if (lua_rawlen(L, index) != 0) {
+#else
+    if (lua_objlen(L, index) != 0) {
+#endif
+        return 0;
+    }
+    int strings = 0;
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        lua_pop(L, 1);
+        int type = lua_type(L, -1);
+        if (type == LUA_TNUMBER) {
+            lua_pop(L, 1);
+            return 0;
+        }
+        strings |= type == LUA_TSTRING;
+    }
+    return strings;
+}
+
+int function_call(lua_State* L) {
+    if (!isPythonFunction(L, 1)) {
+        luaL_error(L, "function_call: Attempt to call a %s object", luaL_typename(L, 1));
+        return 0;
+    }
+    PyObject* function = *(PyObject**)lua_touserdata(L, 1);
+    int nargs = lua_gettop(L) - 1;
+    int kwindex = 0;
+    int nkwargs = 0;
+    if (nargs > 0 && isKeywordTable(L, nargs + 1)) {
+        kwindex = nargs + 1;
+        nargs--;
+        lua_pushnil(L);
+        while (lua_next(L, kwindex) != 0) {
+            if (lua_type(L, -2) == LUA_TSTRING) {
+                nkwargs++;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    Py_XINCREF(function);
+    PyObject* stack[FUNCTION_STACK_ARGS];
+    PyObject** args = allocArgs(L, stack, nargs + nkwargs);
+    for (int i = 0; i < nargs; i++) {
+        PyObject* arg = tryConvertPython(L, i + 2);
+        if (!arg) {
+            for (int j = 0; j < i; j++) {
+                Py_XDECREF(args[j]);
+            }
+            Py_XDECREF(function);
+            PyErr_Print();
+            luaL_error(L, "function_call: Failed to convert argument %d", i + 1);
+            return 0;
+        }
+        args[i] = arg;
+    }
+    PyObject* kwnames = NULL;
+    if (nkwargs > 0) {
+        kwnames = PyTuple_New(nkwargs);
+        int i = 0;
+        lua_pushnil(L);
+        while (lua_next(L, kwindex) != 0) {
+            if (lua_type(L, -2) == LUA_TSTRING) {
+                PyObject* name = internStringPython(L, -2);
+                if (name == NULL) {
+                    for (int j = 0; j < nargs + i; j++) {
+                        Py_XDECREF(args[j]);
+                    }
+                    Py_DECREF(kwnames);
+                    Py_XDECREF(function);
+                    PyErr_Print();
+                    luaL_error(L, "function_call: Invalid keyword name");
+                    return 0;
+                }
+                PyTuple_SetItem(kwnames, i, name);
+                args[nargs + i] = tryConvertPython(L, -1);
+                if (args[nargs + i] == NULL) {
+                    for (int j = 0; j < nargs + i; j++) {
+                        Py_XDECREF(args[j]);
+                    }
+                    Py_DECREF(kwnames);
+                    Py_XDECREF(function);
+                    PyErr_Print();
+                    luaL_error(L, "function_call: Failed to convert keyword argument %s", lua_tostring(L, -2));
+                    return 0;
+                }
+                i++;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    PyObject* result = callPython(function, args, nargs, kwnames);
+    for (int i = 0; i < nargs + nkwargs; i++) {
+        Py_XDECREF(args[i]);
+    }
+    Py_XDECREF(kwnames);
+    Py_XDECREF(function);
+    return pushCallResult(L, result);
+}
+
+typedef struct {
+    PythonProxy proxy;
+    PyObject* kwnames;
+    int nargs;
+    int nkwargs;
+    char kinds[1];
+} PythonCallSite;
+
+#define isPythonCallSite(L, index) isPythonKind(L, index, PROXY_CALLSITE)
+
+// Whether convertKindPython converts the value at index without raising a Lua error. Once it
+// matches, convertKindPython returns NULL with a Python error set instead of raising.
+int matchesKind(lua_State* L, char kind, int index) {
+    switch (kind) {
+    case 'n':
+        return lua_isnumber(L, index);
+    case 'i': {
+#if LUA_VERSION_NUM >= 503
+        int isnum;
+        lua_tointegerx(L, index, &isnum);
+        return isnum;
+#else
+        return lua_isnumber(L, index);
+#endif
+    }
+    case 's':
+        return lua_isstring(L, index);
+    default:
+        return 1;
+    }
+}
+
+PyObject* convertKindPython(lua_State* L, char kind, int index) {
+    switch (kind) {
+    case 'n':
+        return PyFloat_FromDouble(luaL_checknumber(L, index));
+    case 'i':
+        return PyLong_FromLongLong(luaL_checkinteger(L, index));
+    case 's': {
+        size_t len;
+        const char* str = luaL_checklstring(L, index, &len);
+        return PyUnicode_FromStringAndSize(str, len);
+    }
+    case 'b': {
+        PyObject* py_bool = lua_toboolean(L, index) ? Py_True : Py_False;
+        Py_XINCREF(py_bool);
+        return py_bool;
+    }
+    default:
+        return tryConvertPython(L, index);
+    }
+}
+
+int callsite_call(lua_State* L) {
+    if (!isPythonCallSite(L, 1)) {
+        luaL_error(L, "callsite_call: Attempt to call a %s value", luaL_typename(L, 1));
+        return 0;
+    }
+    PythonCallSite* site = (PythonCallSite*)lua_touserdata(L, 1);
+    int count = site->nargs + site->nkwargs;
+    if (lua_gettop(L) - 1 != count) {
+        luaL_error(L, "callsite_call: %d arguments expected, got %d", count, lua_gettop(L) - 1);
+        return 0;
+    }
+    PyObject* stack[FUNCTION_STACK_ARGS];
+    PyObject** args = allocArgs(L, stack, count);
+    for (int i = 0; i < count; i++) {
+        int matches = matchesKind(L, site->kinds[i], i + 2);
+        args[i] = matches ? convertKindPython(L, site->kinds[i], i + 2) : NULL;
+        if (args[i] == NULL) {
+            for (int j = 0; j < i; j++) {
+                Py_DECREF(args[j]);
+            }
+            if (!matches) {
+                luaL_error(L, "callsite_call: Argument %d does not match its kind", i + 1);
+                return 0;
+            }
+            PyErr_Print();
+            luaL_error(L, "callsite_call: Failed to convert argument %d", i + 1);
+            return 0;
+        }
+    }
+    PyObject* result = callPython(site->proxy.obj, args, site->nargs, site->kwnames);
+    for (int i = 0; i < count; i++) {
+        Py_XDECREF(args[i]);
+    }
+    return pushCallResult(L, result);
+}
+
+int callsite_gc(lua_State* L) {
+    PythonCallSite* site = (PythonCallSite*)lua_touserdata(L, 1);
+    PythonContext* context = getPythonContext(L);
+    releaseLater(context, site->proxy.obj);
+    releaseLater(context, site->kwnames);
+    site->proxy.obj = NULL;
+    site->kwnames = NULL;
+    return 0;
+}
+
+// Reads the conversion kind named at index: number, integer, string, boolean or any (also nil).
+char checkKind(lua_State* L, int index, const char* caller) {
+    if (lua_isnil(L, index)) {
+        return 'a';
+    }
+    const char* name = lua_tostring(L, index);
+    if (name == NULL) {
+        luaL_error(L, "%s: Argument kind must be a string, got %s", caller, luaL_typename(L, index));
+        return 0;
+    }
+    if (strcmp(name, "number") == 0) {
+        return 'n';
+    } else if (strcmp(name, "integer") == 0) {
+        return 'i';
+    } else if (strcmp(name, "string") == 0) {
+        return 's';
+    } else if (strcmp(name, "boolean") == 0) {
+        return 'b';
+    } else if (strcmp(name, "any") == 0) {
+        return 'a';
+    }
+    luaL_error(L, "%s: Unknown argument kind %s", caller, name);
+    return 0;
+}
+
+// luapython.prepare(fn, {"number", "string", kwargs = {"name", ...}})
+int python_prepare(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    if (!isPythonObject(L, 1) || !PyCallable_Check(toPythonProxy(L, 1)->obj)) {
+        luaL_error(L, "python_prepare: Attempt to prepare a %s value", luaL_typename(L, 1));
+        return 0;
+    }
+    if (!lua_istable(L, 2)) {
+        luaL_error(L, "python_prepare: Spec table expected, got %s", luaL_typename(L, 2));
+        return 0;
+    }
+    if (context->table_callsite_index == 0) {
+        lua_createtable(L, 0, 4);
+        pushPythonFunction(L, callsite_call);
+        lua_setfield(L, -2, "__call");
+        pushPythonFunction(L, python_tostring);
+        lua_setfield(L, -2, "__tostring");
+        lua_pushcfunction(L, callsite_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushstring(L, PYTHON_CALLSITE_NAME);
+        lua_setfield(L, -2, "__name");
+        registerProxyMetatable(L, PROXY_CALLSITE);
+        context->table_callsite_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+#if LUA_VERSION_NUM >= 502
+    int nargs = (int)lua_rawlen(L, 2);
+#else
+    int nargs = (int)lua_objlen(L, 2);
+#endif
+    lua_getfield(L, 2, "kwargs");
+    int nkwargs = 0;
+    if (lua_istable(L, -1)) {
+#if LUA_VERSION_NUM >= 502
+        nkwargs = (int)lua_rawlen(L, -1);
+#else
+        nkwargs = (int)lua_objlen(L, -1);
+#endif
+    } else if (!lua_isnil(L, -1)) {
+        luaL_error(L, "python_prepare: kwargs must be a list of names");
+        return 0;
+    }
+    PythonCallSite* site = (PythonCallSite*)lua_newuserdata(L, sizeof(PythonCallSite) + nargs + nkwargs);
+    site->proxy.obj = NULL;
+    site->proxy.kind = PROXY_CALLSITE;
+    site->proxy.size = 0;
+    site->kwnames = NULL;
+    site->nargs = nargs;
+    site->nkwargs = nkwargs;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_callsite_index);
+    lua_setmetatable(L, -2);
+    for (int i = 0; i < nargs; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        site->kinds[i] = checkKind(L, -1, "python_prepare");
+        lua_pop(L, 1);
+    }
+    if (nkwargs > 0) {
+        site->kwnames = PyTuple_New(nkwargs);
+        for (int i = 0; i < nkwargs; i++) {
+            lua_rawgeti(L, -2, i + 1);
+            if (lua_type(L, -1) != LUA_TSTRING) {
+                luaL_error(L, "python_prepare: Keyword name must be a string, got %s", luaL_typename(L, -1));
+                return 0;
+            }
+            PyObject* name = internStringPython(L, -1);
+            if (name == NULL) {
+                PyErr_Print();
+                luaL_error(L, "python_prepare: Invalid keyword name");
+                return 0;
+            }
+            PyTuple_SetItem(site->kwnames, i, name);
+            site->kinds[nargs + i] = 'a';
+            lua_pop(L, 1);
+        }
+    }
+    site->proxy.obj = *(PyObject**)lua_touserdata(L, 1);
+    Py_XINCREF(site->proxy.obj);
+    return 1;
+}
+
+// luapython.submit(fn, args...) runs fn(args...) on a worker thread of the state's executor and
+// returns a concurrent.futures.Future. Python releases the GIL around blocking I/O, so the worker
+// waits for the network while Lua carries on; future.done(), future.result(timeout) and
+// luapython.await(future) collect the result.
+int python_submit(lua_State* L) {
+    if (!isPythonObject(L, 1) || !PyCallable_Check(toPythonProxy(L, 1)->obj)) {
+        luaL_error(L, "python_submit: Attempt to submit a %s value", luaL_typename(L, 1));
+        return 0;
+    }
+    int nargs = lua_gettop(L) - 1;
+    int kwindex = 0;
+    if (nargs > 0 && isKeywordTable(L, nargs + 1)) {
+        kwindex = nargs + 1;
+        nargs--;
+    }
+    PyObject* args = PyTuple_New(nargs + 1);
+    if (!args) {
+        PyErr_Print();
+        luaL_error(L, "python_submit: Failed to create arguments");
+        return 0;
+    }
+    PyObject* function = toPythonProxy(L, 1)->obj;
+    Py_XINCREF(function);
+    PyTuple_SetItem(args, 0, function);
+    for (int i = 0; i < nargs; i++) {
+        PyObject* arg = tryConvertPython(L, i + 2);
+        if (!arg) {
+            Py_XDECREF(args);
+            PyErr_Print();
+            luaL_error(L, "python_submit: Failed to convert argument %d", i + 1);
+            return 0;
+        }
+        PyTuple_SetItem(args, i + 1, arg);
+    }
+    PyObject* kwargs = kwindex ? convertDictPython(L, kwindex) : NULL;
+    PyObject* submit = PyObject_GetAttrString(getExecutorPython(L), "submit");
+    PyObject* future = submit ? PyObject_Call(submit, args, kwargs) : NULL;
+    Py_XDECREF(submit);
+    Py_XDECREF(args);
+    Py_XDECREF(kwargs);
+    if (future == NULL) {
+        PyErr_Print();
+        luaL_error(L, "python_submit: Failed to submit the call");
+        return 0;
+    }
+    pushLua(L, future);
+    return 1;
+}
 
 int pushFunctionLua(lua_State* L, PyObject* obj) {
+    PythonContext* context = getPythonContext(L);
     if (!PyCallable_Check(obj)) {
         luaL_error(L, "pushFunctionLua: Function is not callable");
         return 0;
     }
-    if (table_function_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = obj;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_function_index);
+    if (context->table_function_index != 0) {
+        if (pushCachedLua(L, obj, context->table_function_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = obj;
+        proxy->kind = PROXY_FUNCTION;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_function_index);
         if (!lua_istable(L, -1)) {
             luaL_error(L, "pushFunctionLua: Internal error, class index is not a table");
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, obj);
         return 1;
     }
     lua_createtable(L, 0, 5);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, tools_get_python_adapt_function);
-    if(lua_isnil(L, -1)){
-        loadTools(L);
-        lua_pop(L, 1);
-        lua_rawgeti(L, LUA_REGISTRYINDEX, tools_get_python_adapt_function);
-    }
-    lua_pushcfunction(L, function_call);
-    lua_call(L, 1, 1);
+    pushPythonFunction(L, function_call);
     lua_setfield(L, -2, "__call");
-    lua_pushcfunction(L, python_tostring);
+    pushPythonFunction(L, python_tostring);
     lua_setfield(L, -2, "__tostring");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
     lua_pushstring(L, PYTHON_FUNCTION_NAME);
     lua_setfield(L, -2, "__name");
-    lua_pushcfunction(L, python_index);
+    pushPythonFunction(L, python_index);
     lua_setfield(L, -2, "__index");
-    table_function_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_FUNCTION);
+    context->table_function_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushFunctionLua(L, obj);
 }
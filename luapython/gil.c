@@ -0,0 +1,224 @@
+#include "luapython.h"
+#include <time.h>
+
+// The thread that called initialize owns the GIL for as long as Lua runs, unless
+// luapython.release_gil() hands it back to Python. Every other thread, and the owner after a
+// release, takes it around each crossing with PyGILState_Ensure, so several lua_States on
+// several OS threads can share the interpreter. gil_depth counts the acquisitions held by the
+// current thread; nested crossings (a with_gil block, a converter called from pushLua) run
+// straight through. A lua_State with its own sub-interpreter swaps in that interpreter's
+// thread state instead, and waits on that interpreter's GIL only. A released GIL is parked with
+// the thread state of the thread that released it, so only that thread can take it back.
+static __thread int gil_released = 0;
+static __thread PyThreadState* gil_saved = NULL;
+static __thread int gil_depth = 0;
+
+static double gil_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static PyGILState_STATE gil_acquire(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    PyGILState_STATE state = PyGILState_UNLOCKED;
+    double start = gil_now();
+    if (context->interpreter) {
+        PyEval_RestoreThread(context->interpreter);
+    } else {
+        state = PyGILState_Ensure();
+    }
+    double wait = gil_now() - start;
+    context->gil_acquires++;
+    context->gil_wait += wait;
+    if (wait > context->gil_max_wait) {
+        context->gil_max_wait = wait;
+    }
+    gil_depth++;
+    releasePending(context);
+    return state;
+}
+
+static void gil_release(lua_State* L, PyGILState_STATE state) {
+    gil_depth--;
+    if (getPythonContext(L)->interpreter) {
+        PyEval_SaveThread();
+    } else {
+        PyGILState_Release(state);
+    }
+}
+
+// Calls the function at the bottom of the stack with everything above it as arguments.
+static int gil_pcall(lua_State* L) {
+    PyGILState_STATE state = gil_acquire(L);
+    int status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    gil_release(L, state);
+    if (status != LUA_OK) {
+        lua_error(L);
+        return 0;
+    }
+    return lua_gettop(L);
+}
+
+static int gil_call(lua_State* L) {
+    lua_CFunction function = lua_tocfunction(L, lua_upvalueindex(1));
+    PythonContext* context = (PythonContext*)lua_touserdata(L, lua_upvalueindex(2));
+    int results;
+    if (gil_depth > 0) {
+        if (context->pending_count > 0) {
+            releasePending(context);
+        }
+        results = function(L);
+    } else {
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_insert(L, 1);
+        results = gil_pcall(L);
+    }
+    settleGCLua(L, context);
+    return results;
+}
+
+// Pushes a C function that enters Python, wrapped so it holds the GIL while it runs.
+void pushPythonFunction(lua_State* L, lua_CFunction function) {
+    PythonContext* context = getPythonContext(L);
+    lua_pushcfunction(L, function);
+    lua_pushlightuserdata(L, context);
+    lua_pushcclosure(L, gil_call, 2);
+}
+
+// Proxy finalizers only queue their reference here, so a Lua GC step never waits for the GIL
+// or runs Python code. The queue is emptied in bulk the next time this state holds the GIL.
+void releaseLater(PythonContext* context, PyObject* obj) {
+    if (obj == NULL) {
+        return;
+    }
+    if (context->pending_count == context->pending_capacity) {
+        size_t capacity = context->pending_capacity ? context->pending_capacity * 2 : 256;
+        PyObject** pending = (PyObject**)realloc(context->pending, capacity * sizeof(PyObject*));
+        if (pending == NULL) {
+            // Out of memory: release it right away if that is safe, otherwise leak it.
+            if (gil_depth > 0) {
+                Py_DECREF(obj);
+            }
+            return;
+        }
+        context->pending = pending;
+        context->pending_capacity = capacity;
+    }
+    context->pending[context->pending_count++] = obj;
+}
+
+// Needs the GIL of the state's interpreter. A released object may run a finalizer that ends up
+// in releaseLater again, so the queue is re-read on every step.
+void releasePending(PythonContext* context) {
+    while (context->pending_count > 0) {
+        PyObject* obj = context->pending[--context->pending_count];
+        Py_DECREF(obj);
+    }
+}
+
+// Called right after Py_Initialize on the thread that now holds the GIL.
+void holdGIL(void) {
+    gil_depth = 1;
+}
+
+// Takes the GIL for good on this thread, before finalize: back from release_gil on the thread
+// that released it, through PyGILState_Ensure on any other thread.
+void restoreGIL(void) {
+    if (gil_released) {
+        gil_released = 0;
+        PyEval_RestoreThread(gil_saved);
+        gil_saved = NULL;
+        gil_depth = 1;
+    } else if (gil_depth == 0) {
+        PyGILState_Ensure();
+        gil_depth = 1;
+    }
+}
+
+int python_release_gil(lua_State* L) {
+    if (!Py_IsInitialized()) {
+        luaL_error(L, "python_release_gil: luapython has not been loaded");
+        return 0;
+    }
+    if (gil_released) {
+        return 0;
+    }
+    if (gil_depth != 1) {
+        luaL_error(L, "python_release_gil: The GIL is not owned by this thread");
+        return 0;
+    }
+    gil_released = 1;
+    gil_depth = 0;
+    gil_saved = PyEval_SaveThread();
+    return 0;
+}
+
+#ifdef LUAPYTHON_HAS_SUBINTERPRETERS
+
+// Gives this lua_State a sub-interpreter with its own GIL, so states on different threads run
+// Python in parallel. The main interpreter is parked first if this thread still holds it.
+void startInterpreter(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    if (context->interpreter) {
+        return;
+    }
+    if (!gil_released && gil_depth == 1) {
+        python_release_gil(L);
+    }
+    PyInterpreterConfig config = {
+        .use_main_obmalloc = 0,
+        .allow_fork = 0,
+        .allow_exec = 0,
+        .allow_threads = 1,
+        .allow_daemon_threads = 0,
+        .check_multi_interp_extensions = 1,
+        .gil = PyInterpreterConfig_OWN_GIL,
+    };
+    PyThreadState* tstate = NULL;
+    PyStatus status = Py_NewInterpreterFromConfig(&tstate, &config);
+    if (PyStatus_Exception(status) || tstate == NULL) {
+        luaL_error(L, "startInterpreter: Failed to create a sub-interpreter: %s", status.err_msg ? status.err_msg : "unknown error");
+        return;
+    }
+    disableAttrCache();
+    context->interpreter = PyEval_SaveThread();
+}
+
+// Ends the sub-interpreter of a closing lua_State, after its proxies have been collected.
+void stopInterpreter(PythonContext* context) {
+    PyEval_RestoreThread(context->interpreter);
+    releaseContextPython(context);
+    Py_EndInterpreter(context->interpreter);
+    context->interpreter = NULL;
+}
+
+#endif
+
+int python_with_gil(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    if (gil_depth > 0) {
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+        return lua_gettop(L);
+    }
+    return gil_pcall(L);
+}
+
+// Counters are kept per lua_State.
+int python_gil_stats(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    lua_createtable(L, 0, 6);
+    lua_pushboolean(L, gil_released);
+    lua_setfield(L, -2, "released");
+    lua_pushboolean(L, context->interpreter != NULL);
+    lua_setfield(L, -2, "isolated");
+    lua_pushnumber(L, (lua_Number)context->gil_acquires);
+    lua_setfield(L, -2, "acquires");
+    lua_pushnumber(L, context->gil_wait);
+    lua_setfield(L, -2, "wait");
+    lua_pushnumber(L, context->gil_max_wait);
+    lua_setfield(L, -2, "max_wait");
+    lua_pushinteger(L, (lua_Integer)context->pending_count);
+    lua_setfield(L, -2, "pending");
+    return 1;
+}
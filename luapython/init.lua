@@ -4,7 +4,7 @@ local loader = require("luapython.loader")
 -- but we still keep it for advanced users who want to manage the loading process manually.
 -- loader.loadNative = nil
 
-function loader.load(version, lib_prefix)
+function loader.load(version, lib_prefix, options)
 	if not lib_prefix then
 		local check = os.execute("python3-config --exec-prefix > /dev/null 2>&1")
 		if not check then
@@ -27,7 +27,15 @@ function loader.load(version, lib_prefix)
 			local version_info = handle:read()
 			local version_extract = string.match(version_info, "%d%.%d+")
 			if version_extract then
-				version = tonumber(version_extract)
+				version = version_extract
+				-- The free-threaded build ships as libpython3.xt.so
+				local abiflags = io.popen("python3-config --abiflags")
+				if abiflags then
+					if (abiflags:read() or ""):find("t") then
+						version = version .. "t"
+					end
+					abiflags:close()
+				end
 			else
 				check = false
 			end
@@ -48,7 +56,7 @@ function loader.load(version, lib_prefix)
     for k, v in pairs(core) do
         luapython[k] = v
     end
-    luapython.initialize()
+    luapython.initialize(options)
     return path
 end
 
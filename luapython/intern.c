@@ -0,0 +1,101 @@
+#include "luapython.h"
+
+// Attribute names, dict keys and keyword names repeat a lot, so the Python str for a Lua string
+// is kept in a small per-state cache. Slots are found by the address of the Lua string and
+// checked against a copy of its bytes, so a reused address never returns a stale name.
+#define INTERN_WAYS 4
+#define INTERN_SETS 128
+#define INTERN_KEY_SIZE 48
+
+typedef struct {
+    const char* ptr;
+    size_t len;
+    PyObject* str;
+    unsigned long tick;
+    char key[INTERN_KEY_SIZE];
+} InternEntry;
+
+typedef struct {
+    unsigned long tick;
+    InternEntry entries[INTERN_SETS][INTERN_WAYS];
+} InternCache;
+
+static const char intern_cache_key = 0;
+
+// Runs without the GIL like the proxy finalizers. The strings are queued, and the context,
+// created before the cache, releases them when it is collected after it.
+int intern_gc(lua_State* L) {
+    InternCache* cache = (InternCache*)lua_touserdata(L, 1);
+    if (!Py_IsInitialized()) {
+        return 0;
+    }
+    PythonContext* context = getPythonContext(L);
+    for (int set = 0; set < INTERN_SETS; set++) {
+        for (int way = 0; way < INTERN_WAYS; way++) {
+            releaseLater(context, cache->entries[set][way].str);
+            cache->entries[set][way].str = NULL;
+        }
+    }
+    return 0;
+}
+
+static InternCache* getInternCache(lua_State* L) {
+    lua_pushlightuserdata(L, (void*)&intern_cache_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    InternCache* cache = (InternCache*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (cache) {
+        return cache;
+    }
+    cache = (InternCache*)lua_newuserdata(L, sizeof(InternCache));
+    memset(cache, 0, sizeof(InternCache));
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, intern_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, (void*)&intern_cache_key);
+    lua_insert(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    return cache;
+}
+
+// Returns a new reference to the interned Python str for the Lua string at index.
+PyObject* internStringPython(lua_State* L, int index) {
+    size_t len;
+    const char* ptr = lua_tolstring(L, index, &len);
+    if (ptr == NULL) {
+        return NULL;
+    }
+    if (len > INTERN_KEY_SIZE) {
+        return PyUnicode_FromStringAndSize(ptr, len);
+    }
+    InternCache* cache = getInternCache(L);
+    InternEntry* set = cache->entries[((size_t)ptr >> 4) % INTERN_SETS];
+    InternEntry* victim = &set[0];
+    for (int way = 0; way < INTERN_WAYS; way++) {
+        InternEntry* entry = &set[way];
+        if (entry->str && entry->ptr == ptr && entry->len == len && memcmp(entry->key, ptr, len) == 0) {
+            entry->tick = ++cache->tick;
+            Py_INCREF(entry->str);
+            return entry->str;
+        }
+        if (entry->tick < victim->tick) {
+            victim = entry;
+        }
+    }
+    PyObject* str = PyUnicode_FromStringAndSize(ptr, len);
+    if (str == NULL) {
+        return NULL;
+    }
+    PyUnicode_InternInPlace(&str);
+    // Hashing once here lets every later dict or attribute lookup reuse the cached hash.
+    PyObject_Hash(str);
+    Py_XDECREF(victim->str);
+    victim->ptr = ptr;
+    victim->len = len;
+    victim->str = str;
+    victim->tick = ++cache->tick;
+    memcpy(victim->key, ptr, len);
+    Py_INCREF(str);
+    return str;
+}
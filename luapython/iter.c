@@ -1,8 +1,6 @@
 #include "luapython.h"
 
-#define isPythonIter(L, index) (isPythonObject(L, index) && PyIter_Check(*(PyObject**)lua_touserdata(L, index)))
-
-int table_iter_index = 0;
+#define isPythonIter(L, index) isPythonKind(L, index, PROXY_ITER)
 
 int lua_iter(lua_State* L){
     if (!isPythonIter(L, -2)) {
@@ -20,7 +18,9 @@ int lua_iter(lua_State* L){
     PyObject* next = PyIter_Next(iter);
     Py_XDECREF(iter);
     if(PyErr_Occurred()){
-        PyErr_Clear();
+        PyErr_Print();
+        luaL_error(L, "lua_iter: Iteration raised an exception");
+        return 0;
     }
     if(!next) {
         lua_pushnil(L);
@@ -43,31 +43,38 @@ int lua_getiter(lua_State* L){
         lua_pushnil(L);
         return 1;
     }
-    pushClassLua(L, iter);
+    pushIterLua(L, iter);
     return 1;
 }
 
 int pushIterLua(lua_State* L, PyObject* iter) {
-    if(table_iter_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = iter;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_iter_index);
+    PythonContext* context = getPythonContext(L);
+    if(context->table_iter_index != 0) {
+        if (pushCachedLua(L, iter, context->table_iter_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = iter;
+        proxy->kind = PROXY_ITER;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_iter_index);
         if(!lua_istable(L, -1)) {
             luaL_error(L, "pushIterLua: Internal error, class index is not a table");
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, iter);
         return 1;
     }
     lua_createtable(L, 0, 5);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, tools_get_iter_function);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->tools_get_iter_function);
     if(lua_isnil(L, -1)){
         loadTools(L);
         lua_pop(L, 1);
-        lua_rawgeti(L, LUA_REGISTRYINDEX, tools_get_iter_function);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->tools_get_iter_function);
     }
-    lua_pushcfunction(L, lua_iter);
-    lua_pushcfunction(L, lua_getiter);
+    pushPythonFunction(L, lua_iter);
+    pushPythonFunction(L, lua_getiter);
     if(lua_pcall(L, 2, 1, 0) != LUA_OK) {
         luaL_error(L, "pushIterLua: Failed to load iter.lua: %s", lua_tostring(L, -1));
         return 0;
@@ -77,10 +84,194 @@ int pushIterLua(lua_State* L, PyObject* iter) {
     lua_setfield(L, -2, "__name");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
-    lua_pushcfunction(L, python_tostring);
+    pushPythonFunction(L, python_tostring);
     lua_setfield(L, -2, "__tostring");
-    lua_pushcfunction(L, python_index);
+    pushPythonFunction(L, python_index);
     lua_setfield(L, -2, "__index");
-    table_iter_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_ITER);
+    context->table_iter_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushIterLua(L, iter);
-}
\ No newline at end of file
+}
+// luapython.coroutine(gen) drives a Python generator from Lua. co:send(value) resumes it and
+// returns the next yielded value and false, or the return value and true once it finished.
+// co:throw(exc[, message]) raises exc at the paused yield, co:close() stops it early.
+typedef struct {
+    PythonProxy proxy;
+    int dead;
+} PythonCoroutine;
+
+static PythonCoroutine* toCoroutine(lua_State* L, const char* name) {
+    if (!isPythonKind(L, 1, PROXY_COROUTINE)) {
+        luaL_error(L, "%s: Python coroutine expected, got %s", name, luaL_typename(L, 1));
+        return NULL;
+    }
+    PythonCoroutine* co = (PythonCoroutine*)lua_touserdata(L, 1);
+    if (co->dead) {
+        luaL_error(L, "%s: Cannot resume dead coroutine", name);
+        return NULL;
+    }
+    return co;
+}
+
+// Takes the return value out of the pending StopIteration, or returns NULL for other errors.
+static PyObject* takeReturnPython(void) {
+    if (!PyErr_ExceptionMatches(PyExc_StopIteration)) {
+        return NULL;
+    }
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    PyErr_NormalizeException(&type, &value, &traceback);
+    PyObject* result = value ? PyObject_GetAttrString(value, "value") : NULL;
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+    if (result == NULL) {
+        PyErr_Clear();
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+    return result;
+}
+
+// Pushes what the generator produced after it was resumed with result = gen.send(...) or
+// gen.throw(...). Returns an error for exceptions that escaped the generator.
+static int pushResumeLua(lua_State* L, PythonCoroutine* co, PyObject* result, int finished, const char* name) {
+    if (result == NULL) {
+        co->dead = 1;
+        PyErr_Print();
+        luaL_error(L, "%s: Generator raised an exception", name);
+        return 0;
+    }
+    co->dead = finished;
+    pushLua(L, result);
+    lua_pushboolean(L, finished);
+    return 2;
+}
+
+int coroutine_send(lua_State* L) {
+    PythonCoroutine* co = toCoroutine(L, "coroutine_send");
+    PyObject* value = lua_gettop(L) >= 2 ? convertPython(L, 2) : NULL;
+    if (value == NULL) {
+        Py_INCREF(Py_None);
+        value = Py_None;
+    }
+    PyObject* result = NULL;
+    int finished = 0;
+#ifdef LUAPYTHON_HAS_ITER_SEND
+    finished = PyIter_Send(co->proxy.obj, value, &result) == PYGEN_RETURN;
+#else
+    result = PyObject_CallMethod(co->proxy.obj, "send", "O", value);
+    if (result == NULL) {
+        result = takeReturnPython();
+        finished = result != NULL;
+    }
+#endif
+    Py_DECREF(value);
+    return pushResumeLua(L, co, result, finished, "coroutine_send");
+}
+
+int coroutine_throw(lua_State* L) {
+    PythonCoroutine* co = toCoroutine(L, "coroutine_throw");
+    if (!isPythonObject(L, 2)) {
+        luaL_error(L, "coroutine_throw: Python exception expected, got %s", luaL_typename(L, 2));
+        return 0;
+    }
+    // Checked before the reference is taken, luaL_checkstring does not return on a bad message.
+    const char* message = lua_isnoneornil(L, 3) ? NULL : luaL_checkstring(L, 3);
+    PyObject* exc = toPythonProxy(L, 2)->obj;
+    Py_INCREF(exc);
+    if (PyExceptionClass_Check(exc)) {
+        PyObject* instance = message == NULL ? PyObject_CallObject(exc, NULL) : PyObject_CallFunction(exc, "s", message);
+        Py_DECREF(exc);
+        exc = instance;
+    }
+    if (exc == NULL || !PyExceptionInstance_Check(exc)) {
+        Py_XDECREF(exc);
+        PyErr_Clear();
+        luaL_error(L, "coroutine_throw: Python exception expected, got %s", luaL_typename(L, 2));
+        return 0;
+    }
+    PyObject* result = PyObject_CallMethod(co->proxy.obj, "throw", "O", exc);
+    Py_DECREF(exc);
+    int finished = 0;
+    if (result == NULL) {
+        result = takeReturnPython();
+        finished = result != NULL;
+    }
+    return pushResumeLua(L, co, result, finished, "coroutine_throw");
+}
+
+int coroutine_close(lua_State* L) {
+    if (!isPythonKind(L, 1, PROXY_COROUTINE)) {
+        luaL_error(L, "coroutine_close: Python coroutine expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    PythonCoroutine* co = (PythonCoroutine*)lua_touserdata(L, 1);
+    if (co->dead || co->proxy.obj == NULL) {
+        return 0;
+    }
+    co->dead = 1;
+    PyObject* result = PyObject_CallMethod(co->proxy.obj, "close", NULL);
+    if (result == NULL) {
+        PyErr_Print();
+        luaL_error(L, "coroutine_close: Generator raised an exception");
+        return 0;
+    }
+    Py_DECREF(result);
+    return 0;
+}
+
+int coroutine_status(lua_State* L) {
+    if (!isPythonKind(L, 1, PROXY_COROUTINE)) {
+        luaL_error(L, "coroutine_status: Python coroutine expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    lua_pushstring(L, ((PythonCoroutine*)lua_touserdata(L, 1))->dead ? "dead" : "suspended");
+    return 1;
+}
+
+int python_coroutine(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    PyObject* gen = isPythonObject(L, 1) ? toPythonProxy(L, 1)->obj : NULL;
+    if (gen == NULL || !PyIter_Check(gen) || !PyObject_HasAttrString(gen, "send") ||
+        !PyObject_HasAttrString(gen, "throw")) {
+        luaL_error(L, "python_coroutine: Generator expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    if (context->table_coroutine_index == 0) {
+        lua_createtable(L, 0, 6);
+        lua_createtable(L, 0, 4);
+        pushPythonFunction(L, coroutine_send);
+        lua_setfield(L, -2, "send");
+        pushPythonFunction(L, coroutine_throw);
+        lua_setfield(L, -2, "throw");
+        pushPythonFunction(L, coroutine_close);
+        lua_setfield(L, -2, "close");
+        lua_pushcfunction(L, coroutine_status);
+        lua_setfield(L, -2, "status");
+        lua_setfield(L, -2, "__index");
+        pushPythonFunction(L, coroutine_send);
+        lua_setfield(L, -2, "__call");
+#if LUA_VERSION_NUM >= 504
+        pushPythonFunction(L, coroutine_close);
+        lua_setfield(L, -2, "__close");
+#endif
+        pushPythonFunction(L, python_tostring);
+        lua_setfield(L, -2, "__tostring");
+        lua_pushcfunction(L, python_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushstring(L, PYTHON_COROUTINE_NAME);
+        lua_setfield(L, -2, "__name");
+        registerProxyMetatable(L, PROXY_COROUTINE);
+        context->table_coroutine_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    PythonCoroutine* co = (PythonCoroutine*)lua_newuserdata(L, sizeof(PythonCoroutine));
+    Py_INCREF(gen);
+    co->proxy.obj = gen;
+    co->proxy.kind = PROXY_COROUTINE;
+    co->proxy.size = 0;
+    co->dead = 0;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_coroutine_index);
+    lua_setmetatable(L, -2);
+    return 1;
+}
@@ -1,6 +1,6 @@
 #include "luapython.h"
 
-#define isPythonList(L, index) (isPythonObject(L, index) && PyList_Check(*(PyObject**)lua_touserdata(L, index)))
+#define isPythonList(L, index) isPythonKind(L, index, PROXY_LIST)
 
 int list_len(lua_State* L) {
     if (!(lua_istable(L, -1) || isPythonList(L, -1))) {
@@ -53,8 +53,15 @@ int list_index(lua_State* L) {
         lua_pushnil(L);
         return 1;
     }
+#ifdef LUAPYTHON_HAS_ITEM_REF
+    PyObject* py_value = PyList_GetItemRef(py_list, py_idx);
+    if (!py_value) {
+        PyErr_Clear();
+    }
+#else
     PyObject* py_value = PyList_GetItem(py_list, py_idx);
     Py_XINCREF(py_value);
+#endif
     pushLua(L, py_value);
     return 1;
 }
@@ -91,7 +98,6 @@ int list_newindex(lua_State* L) {
         return 0;
     }
     int result = PyList_SetItem(py_list, py_idx, py_value);
-    Py_XDECREF(py_value);
     Py_XDECREF(py_list);
     if (result < 0) {
         luaL_error(L, "list_newindex: Failed to set list item");
@@ -125,25 +131,28 @@ int list_add(lua_State* L) {
         luaL_error(L, "list_add: Failed to create Python lists");
         return 0;
     }
-    PyObject* result = PyList_New(PyList_Size(py_list1) + PyList_Size(py_list2));
-    if (!result) {
-        Py_XDECREF(py_list1);
-        Py_XDECREF(py_list2);
-        Py_XDECREF(result);
-        luaL_error(L, "list_add: Failed to create new list");
-        return 0;
-    }
-    for (Py_ssize_t i = 0; i < PyList_Size(py_list1); ++i) {
+    PyObject* result = NULL;
+    LUAPYTHON_BEGIN_CRITICAL_SECTION2(py_list1, py_list2);
+    Py_ssize_t offset = PyList_Size(py_list1);
+    Py_ssize_t size = PyList_Size(py_list2);
+    result = PyList_New(offset + size);
+    for (Py_ssize_t i = 0; result && i < offset; ++i) {
         PyObject* item = PyList_GetItem(py_list1, i);
         Py_XINCREF(item);
         PyList_SetItem(result, i, item);
     }
-    Py_ssize_t offset = PyList_Size(py_list1);
-    for (Py_ssize_t i = 0; i < PyList_Size(py_list2); ++i) {
+    for (Py_ssize_t i = 0; result && i < size; ++i) {
         PyObject* item = PyList_GetItem(py_list2, i);
         Py_XINCREF(item);
         PyList_SetItem(result, offset + i, item);
     }
+    LUAPYTHON_END_CRITICAL_SECTION2();
+    if (!result) {
+        Py_XDECREF(py_list1);
+        Py_XDECREF(py_list2);
+        luaL_error(L, "list_add: Failed to create new list");
+        return 0;
+    }
     Py_XDECREF(py_list1);
     Py_XDECREF(py_list2);
     pushListLua(L, result);
@@ -193,42 +202,49 @@ int list_mul(lua_State* L) {
     return 1;
 }
 
-int table_list_index = 0;
-
 int pushListLua(lua_State* L, PyObject* obj) {
+    PythonContext* context = getPythonContext(L);
     if (!PyList_Check(obj)) {
         luaL_error(L, "pushListLua: Attempt to push a non-list Python object");
         return 0;
     }
-    if (table_list_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = obj;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_list_index);
+    if (context->table_list_index != 0) {
+        if (pushCachedLua(L, obj, context->table_list_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = obj;
+        proxy->kind = PROXY_LIST;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_list_index);
         if (!lua_istable(L, -1)) {
             luaL_error(L, "pushListLua: Internal error, class index is not a table");
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, obj);
+        accountLua(L, proxy, sizeOfPython(context, obj));
         return 1;
     }
     lua_createtable(L, 0, 8);
-    lua_pushcfunction(L, list_len);
+    pushPythonFunction(L, list_len);
     lua_setfield(L, -2, "__len");
-    lua_pushcfunction(L, list_add);
+    pushPythonFunction(L, list_add);
     lua_setfield(L, -2, "__add");
-    lua_pushcfunction(L, list_mul);
+    pushPythonFunction(L, list_mul);
     lua_setfield(L, -2, "__mul");
-    lua_pushcfunction(L, list_index);
+    pushPythonFunction(L, list_index);
     lua_setfield(L, -2, "__index");
-    lua_pushcfunction(L, list_newindex);
+    pushPythonFunction(L, list_newindex);
     lua_setfield(L, -2, "__newindex");
-    lua_pushcfunction(L, python_tostring);
+    pushPythonFunction(L, python_tostring);
     lua_setfield(L, -2, "__tostring");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
     lua_pushstring(L, PYTHON_LIST_NAME);
     lua_setfield(L, -2, "__name");
-    table_list_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_LIST);
+    context->table_list_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushListLua(L, obj);
 }
 
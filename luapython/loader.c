@@ -2,19 +2,27 @@
 #include <lauxlib.h>
 #include <lualib.h>
 #include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
 
 void* dl_addr = NULL;
+static char* dl_path = NULL;
 
 static int loadPython(lua_State* L){
+    const char* path = lua_tostring(L, -1);
     if(dl_addr != NULL){
+        // Other lua_States in the process share the library that is already loaded.
+        if(path && dl_path && strcmp(path, dl_path) == 0){
+            return 0;
+        }
         luaL_error(L, "luapython has been loaded");
         return 0;
     }
-    const char* path = lua_tostring(L, -1);
     dl_addr = dlopen(path, RTLD_LAZY | RTLD_GLOBAL);
     if(!dl_addr){
         luaL_error(L, "Failed to load %s\n%s", path, dlerror());
     }
+    dl_path = strdup(path);
     return 0;
 }
 
@@ -1,11 +1,31 @@
 #include "luapython.h"
 
+// Further lua_States simply attach to the running interpreter; the first one must have called
+// luapython.release_gil() for them to get the GIL. With {isolated = true} the state gets a
+// sub-interpreter with its own GIL instead (Python 3.12+, full API builds only).
 static int python_initialize(lua_State* L) {
-    if (Py_IsInitialized()) {
-        luaL_error(L, "luapython has been loaded");
+    getPythonContext(L);
+    int isolated = 0;
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "isolated");
+        isolated = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+#ifndef LUAPYTHON_HAS_SUBINTERPRETERS
+    if (isolated) {
+        luaL_error(L, "python_initialize: Isolated interpreters need Python 3.12 and a LIMITED_API=0 build");
         return 0;
     }
-    Py_Initialize();
+#endif
+    if (!Py_IsInitialized()) {
+        Py_Initialize();
+        holdGIL();
+    }
+#ifdef LUAPYTHON_HAS_SUBINTERPRETERS
+    if (isolated) {
+        startInterpreter(L);
+    }
+#endif
     return 0;
 }
 
@@ -14,6 +34,13 @@ static int python_finalize(lua_State* L) {
         luaL_error(L, "luapython has not been loaded");
         return 0;
     }
+    if (getPythonContext(L)->interpreter) {
+        luaL_error(L, "python_finalize: An isolated interpreter ends when its lua_State is closed");
+        return 0;
+    }
+    restoreGIL();
+    releasePending(getPythonContext(L));
+    clearAttrCache();
     Py_Finalize();
     return 0;
 }
@@ -103,12 +130,19 @@ int python_tostring(lua_State* L) {
 }
 
 int python_gc(lua_State* L) {
-    if (!isPythonObject(L, -1)) {
+    if (!isPythonProxy(L, -1)) {
         luaL_error(L, "python_gc: Not a Python object");
         return 0;
     }
-    PyObject* obj = *(PyObject**)lua_touserdata(L, -1);
-    Py_XDECREF(obj);
+    if (toPythonProxy(L, -1)->obj == NULL) {
+        // Already released by a scope.
+        return 0;
+    }
+    PythonContext* context = getPythonContext(L);
+    PythonProxy* proxy = toPythonProxy(L, -1);
+    unaccountLua(context, proxy);
+    releaseLater(context, proxy->obj);
+    proxy->obj = NULL;
     return 0;
 }
 
@@ -117,19 +151,21 @@ int python_index(lua_State* L) {
         luaL_error(L, "python_index: Attempt to index a %s value", luaL_typename(L, -2));
         return 0;
     }
-    const char* key = lua_tostring(L, -1);
     if (!isPythonObject(L, -2)) {
         luaL_error(L, "python_index: Not a Python object");
         return 0;
     }
-    PyObject* obj = *(PyObject**)lua_touserdata(L, -2);
-    Py_XINCREF(obj);
-    if (!PyObject_HasAttrString(obj, key)) {
+    PyObject* key = lua_type(L, -1) == LUA_TSTRING ? internStringPython(L, -1) : convertStringPython(L, -1);
+    if (key == NULL) {
+        // A name that is not valid UTF-8 can not be an attribute.
+        PyErr_Clear();
         lua_pushnil(L);
-        Py_XDECREF(obj);
         return 1;
     }
-    PyObject* attr = PyObject_GetAttrString(obj, key);
+    PyObject* obj = *(PyObject**)lua_touserdata(L, -2);
+    Py_XINCREF(obj);
+    PyObject* attr = getAttrPython(obj, key);
+    Py_XDECREF(key);
     Py_XDECREF(obj);
     pushLua(L, attr);
     return 1;
@@ -140,7 +176,6 @@ int python_newindex(lua_State* L) {
         luaL_error(L, "python_newindex: Attempt to index a %s value", luaL_typename(L, -3));
         return 0;
     }
-    const char* key = lua_tostring(L, -2);
     if (!isPythonObject(L, -3)) {
         luaL_error(L, "python_newindex: Not a Python object");
         return 0;
@@ -153,7 +188,16 @@ int python_newindex(lua_State* L) {
         luaL_error(L, "python_newindex: Failed to convert value to Python object");
         return 0;
     }
-    int result = PyObject_SetAttrString(obj, key, value);
+    PyObject* key = lua_type(L, -2) == LUA_TSTRING ? internStringPython(L, -2) : convertStringPython(L, -2);
+    if (key == NULL) {
+        Py_XDECREF(obj);
+        Py_XDECREF(value);
+        PyErr_Print();
+        luaL_error(L, "python_newindex: Invalid attribute name");
+        return 0;
+    }
+    int result = PyObject_SetAttr(obj, key, value);
+    Py_XDECREF(key);
     Py_XDECREF(obj);
     Py_XDECREF(value);
     if (result != 0) {
@@ -174,49 +218,441 @@ int python_addr(lua_State* L) {
     return 1;
 }
 
+// Call with a newly created proxy metatable on top of the stack, before anchoring it.
+// A userdata is a proxy exactly when its metatable is the one of the kind in its header, which
+// avoids reading and comparing __name on every check.
+void registerProxyMetatable(lua_State* L, int kind) {
+    getPythonContext(L)->proxy_metatables[kind] = lua_topointer(L, -1);
+}
+
+// Whether the value at index is a proxy, live or released. The size check makes reading the
+// kind of a foreign userdata safe.
+int isPythonProxy(lua_State* L, int index) {
+#if LUA_VERSION_NUM >= 502
+    size_t size = lua_rawlen(L, index);
+#else
+    size_t size = lua_objlen(L, index);
+#endif
+    if (lua_type(L, index) != LUA_TUSERDATA || size < sizeof(PythonProxy) || lua_getmetatable(L, index) == 0) {
+        return 0;
+    }
+    const void* metatable = lua_topointer(L, -1);
+    lua_pop(L, 1);
+    int kind = toPythonProxy(L, index)->kind;
+    return kind >= 0 && kind < PROXY_KIND_COUNT && getPythonContext(L)->proxy_metatables[kind] == metatable;
+}
+
 int isPythonObject(lua_State* L, int index) {
-    if (lua_getmetatable(L, index) == 1) {
-        lua_getfield(L, -1, "__name");
-        if (lua_type(L, -1) == LUA_TSTRING) {
-            const char* name = lua_tostring(L, -1);
+    // Proxies released by a scope keep their metatable but no object.
+    return isPythonProxy(L, index) && toPythonProxy(L, index)->obj != NULL;
+}
+
+static const char proxy_cache_key = 0;
+
+// Weak-valued table from PyObject* to its live proxy, so pushing the same object twice
+// returns the same userdata instead of allocating a new one.
+static void getProxyCache(lua_State* L) {
+    lua_pushlightuserdata(L, (void*)&proxy_cache_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_istable(L, -1)) {
+        return;
+    }
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, (void*)&proxy_cache_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+// Pushes the cached proxy of obj if it uses the given metatable. The proxy already owns a
+// reference, so the one passed in is released.
+int pushCachedLua(lua_State* L, PyObject* obj, int metatable) {
+    getProxyCache(L);
+    lua_pushlightuserdata(L, obj);
+    lua_rawget(L, -2);
+    if (lua_isuserdata(L, -1) && lua_getmetatable(L, -1)) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, metatable);
+        if (lua_rawequal(L, -1, -2)) {
             lua_pop(L, 2);
-            return strncmp(name, PYTHON_OBJECT_NAME, 6) == 0;
+            lua_remove(L, -2);
+            Py_XDECREF(obj);
+            return 1;
         }
         lua_pop(L, 2);
     }
+    lua_pop(L, 2);
     return 0;
 }
 
-int pushLua(lua_State* L, PyObject* obj) {
-    if(obj == NULL || Py_IsNone(obj)) {
+// Records the proxy on top of the stack as the one for obj, and in the innermost open scope.
+void cacheLua(lua_State* L, PyObject* obj) {
+    getProxyCache(L);
+    lua_pushlightuserdata(L, obj);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    PythonContext* context = getPythonContext(L);
+    if (context->scope_count != 0) {
+        // Recorded by the innermost scope of the running coroutine, if it has one.
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->scope_threads);
+        lua_pushthread(L);
+        lua_rawget(L, -2);
+        if (lua_istable(L, -1)) {
+            lua_pushvalue(L, -3);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, -3);
+        }
+        lua_pop(L, 2);
+    }
+}
+
+// Forgets the proxy at index as the one for obj, so the next push creates a new proxy.
+void uncacheLua(lua_State* L, PyObject* obj, int index) {
+    if (index < 0) {
+        index = lua_gettop(L) + index + 1;
+    }
+    getProxyCache(L);
+    lua_pushlightuserdata(L, obj);
+    lua_rawget(L, -2);
+    if (lua_rawequal(L, -1, index)) {
+        lua_pushlightuserdata(L, obj);
         lua_pushnil(L);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 2);
+}
+
+enum {
+    CONVERT_NONE,
+    CONVERT_BOOLEAN,
+    CONVERT_BUFFER,
+    CONVERT_NUMBER,
+    CONVERT_STRING,
+    CONVERT_SET,
+    CONVERT_DICT,
+    CONVERT_TUPLE,
+    CONVERT_LIST,
+    CONVERT_MODULE,
+    CONVERT_FUNCTION,
+    CONVERT_ITER,
+    CONVERT_CLASS,
+    CONVERT_USER
+};
+
+static const char converters_key = 0;
+static const char resolved_converters_key = 0;
+
+void clearConvertCache(PythonContext* context) {
+    for (int i = 0; i < CONVERT_CACHE_SIZE; i++) {
+        Py_XDECREF((PyObject*)context->convert_cache[i].type);
+        context->convert_cache[i].type = NULL;
+    }
+}
+
+// PyNumber_Check accepts anything with a number slot, including numpy arrays and pandas objects.
+// Beyond the builtin number types only instances of numbers.Number are treated as numbers.
+static int isNumberPython(PythonContext* context, PyObject* obj) {
+    if (PyLong_Check(obj) || PyFloat_Check(obj) || PyComplex_Check(obj)) {
         return 1;
-    }else if (PyBool_Check(obj)) {
+    }
+    if (!PyNumber_Check(obj)) {
+        return 0;
+    }
+    if (context->numbers_number == NULL) {
+        PyObject* numbers = PyImport_ImportModule("numbers");
+        if (numbers) {
+            context->numbers_number = PyObject_GetAttrString(numbers, "Number");
+            Py_DECREF(numbers);
+        }
+        if (context->numbers_number == NULL) {
+            PyErr_Clear();
+            return 1;
+        }
+    }
+    int result = PyObject_IsInstance(obj, context->numbers_number);
+    if (result < 0) {
+        PyErr_Clear();
+        return 0;
+    }
+    return result;
+}
+
+static int classifyPython(PythonContext* context, PyObject* obj) {
+    if (PyBool_Check(obj)) {
+        return CONVERT_BOOLEAN;
+#ifdef LUAPYTHON_HAS_BUFFER
+    } else if (PyObject_CheckBuffer(obj) && !PyFloat_Check(obj)) {
+        return CONVERT_BUFFER;
+#endif
+    } else if (isNumberPython(context, obj)) {
+        return CONVERT_NUMBER;
+    } else if (PyUnicode_Check(obj)) {
+        return CONVERT_STRING;
+    } else if (PySet_Check(obj)) {
+        return CONVERT_SET;
+    } else if (PyDict_Check(obj)) {
+        return CONVERT_DICT;
+    } else if (PyTuple_Check(obj)) {
+        return CONVERT_TUPLE;
+    } else if (PyList_Check(obj)) {
+        return CONVERT_LIST;
+    } else if (PyModule_Check(obj)) {
+        return CONVERT_MODULE;
+    } else if (PyCallable_Check(obj)) {
+        return CONVERT_FUNCTION;
+    } else if (PyIter_Check(obj)) {
+        return CONVERT_ITER;
+    }
+    return CONVERT_CLASS;
+}
+
+static int pushKindLua(lua_State* L, PyObject* obj, int kind) {
+    switch (kind) {
+    case CONVERT_BOOLEAN:
         lua_pushboolean(L, obj == Py_True);
         return 1;
-    }else if (PyNumber_Check(obj)) {
+#ifdef LUAPYTHON_HAS_BUFFER
+    case CONVERT_BUFFER:
+        return pushBufferLua(L, obj);
+#endif
+    case CONVERT_NUMBER:
         return pushNumberLua(L, obj);
-    } else if (PyUnicode_Check(obj)) {
+    case CONVERT_STRING:
         return pushStringLua(L, obj);
-    } else if (PySet_Check(obj)) {
+    case CONVERT_SET:
         return pushSetLua(L, obj);
-    } else if (PyDict_Check(obj)) {
+    case CONVERT_DICT:
         return pushDictLua(L, obj);
-    } else if (PyTuple_Check(obj)) {
+    case CONVERT_TUPLE:
         return pushTupleLua(L, obj);
-    } else if (PyList_Check(obj)) {
+    case CONVERT_LIST:
         return pushListLua(L, obj);
-    } else if (PyModule_Check(obj)) {
+    case CONVERT_MODULE:
         return pushModuleLua(L, obj);
-    } else if (PyCallable_Check(obj)) {
+    case CONVERT_FUNCTION:
         return pushFunctionLua(L, obj);
-    } else if (PyIter_Check(obj)) {
+    case CONVERT_ITER:
         return pushIterLua(L, obj);
-    } else {
+    default:
         return pushClassLua(L, obj);
     }
 }
 
+static void getConverters(lua_State* L, const char* key) {
+    lua_pushlightuserdata(L, (void*)key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_istable(L, -1)) {
+        return;
+    }
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushlightuserdata(L, (void*)key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+// Finds the converter registered for the type of obj or its nearest base and records it
+// for the exact type. Leaves the function or nil on the stack.
+static void resolveConverter(lua_State* L, PyTypeObject* type) {
+    getConverters(L, &resolved_converters_key);
+    lua_pushlightuserdata(L, type);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+    PyObject* mro = PyObject_GetAttrString((PyObject*)type, "__mro__");
+    if (mro == NULL || !PyTuple_Check(mro)) {
+        PyErr_Clear();
+        Py_XDECREF(mro);
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        return;
+    }
+    getConverters(L, &converters_key);
+    Py_ssize_t size = PyTuple_Size(mro);
+    for (Py_ssize_t i = 0; i < size; i++) {
+        lua_pushlightuserdata(L, PyTuple_GetItem(mro, i));
+        lua_rawget(L, -2);
+        if (!lua_isnil(L, -1)) {
+            lua_pushlightuserdata(L, type);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -5);
+            lua_remove(L, -2);
+            lua_remove(L, -2);
+            Py_DECREF(mro);
+            return;
+        }
+        lua_pop(L, 1);
+    }
+    Py_DECREF(mro);
+    lua_pop(L, 2);
+    lua_pushnil(L);
+}
+
+int pushLua(lua_State* L, PyObject* obj) {
+    if(obj == NULL || Py_IsNone(obj)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    PythonContext* context = getPythonContext(L);
+    PyTypeObject* type = Py_TYPE(obj);
+    ConvertEntry* entry = &context->convert_cache[((size_t)type >> 4) % CONVERT_CACHE_SIZE];
+    if (entry->type != type) {
+        int kind = classifyPython(context, obj);
+        int converter = LUA_NOREF;
+        if (context->converter_count > 0) {
+            resolveConverter(L, type);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+            } else {
+                converter = luaL_ref(L, LUA_REGISTRYINDEX);
+            }
+        }
+        if (entry->type != NULL && entry->kind == CONVERT_USER) {
+            luaL_unref(L, LUA_REGISTRYINDEX, entry->converter);
+        }
+        Py_INCREF((PyObject*)type);
+        Py_XDECREF((PyObject*)entry->type);
+        entry->type = type;
+        entry->kind = converter != LUA_NOREF ? CONVERT_USER : kind;
+        entry->base = kind;
+        entry->converter = converter;
+    }
+    if (entry->kind != CONVERT_USER) {
+        return pushKindLua(L, obj, entry->kind);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, entry->converter);
+    pushKindLua(L, obj, entry->base);
+    lua_call(L, 1, 1);
+    return 1;
+}
+
+// luapython.register_converter(pytype, fn) makes pushLua return fn(proxy) for instances of
+// pytype and its subclasses. Passing nil as fn removes the converter.
+int python_register_converter(lua_State* L) {
+    if (!isPythonObject(L, 1) || !PyType_Check(toPythonProxy(L, 1)->obj)) {
+        luaL_error(L, "python_register_converter: Python type expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    if (!lua_isfunction(L, 2) && !lua_isnil(L, 2)) {
+        luaL_error(L, "python_register_converter: Function expected, got %s", luaL_typename(L, 2));
+        return 0;
+    }
+    PythonContext* context = getPythonContext(L);
+    PyObject* type = toPythonProxy(L, 1)->obj;
+    getConverters(L, &converters_key);
+    lua_pushlightuserdata(L, type);
+    lua_rawget(L, -2);
+    int existed = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (!existed && !lua_isnil(L, 2)) {
+        Py_INCREF(type);
+        context->converter_count++;
+    } else if (existed && lua_isnil(L, 2)) {
+        Py_DECREF(type);
+        context->converter_count--;
+    }
+    lua_pushlightuserdata(L, type);
+    lua_pushvalue(L, 2);
+    lua_rawset(L, -3);
+    lua_pushlightuserdata(L, (void*)&resolved_converters_key);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    for (int i = 0; i < CONVERT_CACHE_SIZE; i++) {
+        if (context->convert_cache[i].type != NULL && context->convert_cache[i].kind == CONVERT_USER) {
+            luaL_unref(L, LUA_REGISTRYINDEX, context->convert_cache[i].converter);
+        }
+    }
+    clearConvertCache(context);
+    return 0;
+}
+
+// Converts a table without calling into Lua, or returns NULL with a Python error set after
+// releasing what was converted. Counting the keys first decides the shape: a table with at least
+// as many string keys as number keys becomes a dict with its number keys as strings, otherwise a
+// list of the values at 1..#t with holes as None, and only the values that are kept get converted.
+static PyObject* convertTablePython(lua_State* L, int index) {
+    if (index < 0) {
+        index = lua_gettop(L) + index + 1;
+    }
+    if (!lua_checkstack(L, 4)) {
+        PyErr_SetString(PyExc_RecursionError, "Lua table nested too deeply");
+        return NULL;
+    }
+    size_t numbers = 0;
+    size_t strings = 0;
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        int type = lua_type(L, -2);
+        numbers += type == LUA_TNUMBER;
+        strings += type == LUA_TSTRING;
+        lua_pop(L, 1);
+    }
+    if (strings < numbers) {
+#if LUA_VERSION_NUM >= 502
+        lua_Integer len = (lua_Integer)lua_rawlen(L, index);
+#else
+        lua_Integer len = (lua_Integer)lua_objlen(L, index);
+#endif
+        PyObject* list = PyList_New(len);
+        for (lua_Integer i = 1; list && i <= len; i++) {
+            lua_rawgeti(L, index, i);
+            PyObject* value = tryConvertPython(L, -1);
+            lua_pop(L, 1);
+            if (value == NULL) {
+                Py_CLEAR(list);
+            } else {
+                PyList_SetItem(list, i - 1, value);
+            }
+        }
+        return list;
+    }
+    PyObject* dict = PyDict_New();
+    lua_pushnil(L);
+    while (dict && lua_next(L, index) != 0) {
+        int type = lua_type(L, -2);
+        if (type == LUA_TNUMBER || type == LUA_TSTRING) {
+            // A copy, lua_tolstring would turn a number key into a string and break lua_next.
+            lua_pushvalue(L, -2);
+            PyObject* key = internStringPython(L, -1);
+            lua_pop(L, 1);
+            PyObject* value = key ? tryConvertPython(L, -1) : NULL;
+            if (value == NULL || PyDict_SetItem(dict, key, value) != 0) {
+                Py_CLEAR(dict);
+                lua_pop(L, 1);
+            }
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+        }
+        lua_pop(L, 1);
+    }
+    return dict;
+}
+
+// Like convertPython, but returns NULL with a Python error set instead of raising a Lua error, so
+// callers holding references can release them first.
+PyObject* tryConvertPython(lua_State* L, int index) {
+    int type = lua_type(L, index);
+    if (type == LUA_TTABLE) {
+        return convertTablePython(L, index);
+    }
+    if (type == LUA_TFUNCTION || type == LUA_TTHREAD || type == LUA_TNONE) {
+        PyErr_Format(PyExc_TypeError, "Unsupported Lua type for conversion to Python: %s", luaL_typename(L, index));
+        return NULL;
+    }
+    PyObject* obj = convertPython(L, index);
+    if (obj == NULL && !PyErr_Occurred()) {
+        PyErr_SetString(PyExc_ValueError, "Python object was released");
+    }
+    return obj;
+}
+
 PyObject* convertPython(lua_State* L, int index) {
     if (lua_isuserdata(L, index)) {
         PyObject* obj = *((PyObject**)lua_touserdata(L, index));
@@ -234,70 +670,101 @@ PyObject* convertPython(lua_State* L, int index) {
         Py_XINCREF(Py_None);
         return Py_None;
     } else if (lua_istable(L, index)) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, tools_should_convert_to_dict);
-        if(lua_isnil(L, -1)){
-            loadTools(L);
-            lua_pop(L, 1);
-            lua_rawgeti(L, LUA_REGISTRYINDEX, tools_should_convert_to_dict);
-        }
-        lua_pushvalue(L, index > 0 ? index + 1 : index - 1);
-        if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
-            luaL_error(L, "Error running function `convert`: %s", lua_tostring(L, -1));
-            return NULL;
-        }
-        PyObject* pyobject = NULL;
-        int is_dict = lua_toboolean(L, -1);
-        lua_pop(L, 1);
-        if (is_dict) {
-            pyobject = convertDictPython(L, index);
-        } else {
-            pyobject = convertListPython(L, index);
+        PyObject* obj = convertTablePython(L, index);
+        if (obj == NULL) {
+            PyErr_Print();
+            luaL_error(L, "convertTablePython: Failed to convert Lua table");
         }
-        return pyobject;
+        return obj;
     }
     luaL_error(L, "Unsupported Lua type for conversion to Python: %s", luaL_typename(L, index));
     return NULL;
 }
 
 int luaopen_luapython_core(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
     lua_createtable(L, 0, 10);
     if(luaL_dostring(L, "local lib = require(\"luapython.import\") return lib") != LUA_OK){
         luaL_error(L, "luaopen_luapython_core: Failed to load internal tools");
     }
-    lua_pushcfunction(L, python_import);
+    pushPythonFunction(L, python_import);
     if(lua_pcall(L, 1, 1, 0) != LUA_OK){
         luaL_error(L, "luaopen_luapython_core: Failed to get import function: %s", lua_tostring(L, -1));
     }
     int idx = LUA_REGISTRYINDEX;
     lua_setfield(L, -2, "import");
-    lua_pushcfunction(L, python_set);
+    pushPythonFunction(L, python_set);
     lua_setfield(L, -2, "set");
-    lua_pushcfunction(L, python_dict);
+    pushPythonFunction(L, python_dict);
     lua_setfield(L, -2, "dict");
-    lua_pushcfunction(L, python_tuple);
+    pushPythonFunction(L, python_tuple);
     lua_setfield(L, -2, "tuple");
-    lua_pushcfunction(L, python_list);
+    pushPythonFunction(L, python_list);
     lua_setfield(L, -2, "list");
-    lua_pushcfunction(L, luapython_astable);
+    pushPythonFunction(L, luapython_astable);
     lua_setfield(L, -2, "astable");
-    lua_rawgeti(L, idx, tools_release_to_env);
+    pushPythonFunction(L, luapython_totable);
+    lua_setfield(L, -2, "totable");
+    pushPythonFunction(L, python_prepare);
+    lua_setfield(L, -2, "prepare");
+    pushPythonFunction(L, python_submit);
+    lua_setfield(L, -2, "submit");
+    pushPythonFunction(L, python_pmap);
+    lua_setfield(L, -2, "pmap");
+    pushPythonFunction(L, python_channel);
+    lua_setfield(L, -2, "channel");
+    pushPythonFunction(L, python_schema);
+    lua_setfield(L, -2, "schema");
+    pushPythonFunction(L, python_columns);
+    lua_setfield(L, -2, "columns");
+    lua_pushcfunction(L, python_kw);
+    lua_setfield(L, -2, "kw");
+    pushPythonFunction(L, python_register_converter);
+    lua_setfield(L, -2, "register_converter");
+    lua_pushcfunction(L, python_release_gil);
+    lua_setfield(L, -2, "release_gil");
+    lua_pushcfunction(L, python_with_gil);
+    lua_setfield(L, -2, "with_gil");
+    lua_pushcfunction(L, python_gil_stats);
+    lua_setfield(L, -2, "gil_stats");
+    lua_pushcfunction(L, python_gc_policy);
+    lua_setfield(L, -2, "gc_policy");
+    lua_pushcfunction(L, python_scope);
+    lua_setfield(L, -2, "scope");
+    pushPythonFunction(L, python_release);
+    lua_setfield(L, -2, "release");
+    lua_rawgeti(L, idx, context->tools_release_to_env);
     if(lua_isnil(L, -1)){
         loadTools(L);
         lua_pop(L, 1);
-        lua_rawgeti(L, LUA_REGISTRYINDEX, tools_release_to_env);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->tools_release_to_env);
     }
     lua_setfield(L, -2, "init");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->tools_get_await_function);
+    pushPythonFunction(L, async_schedule);
+    pushPythonFunction(L, async_step);
+    pushPythonFunction(L, async_finish);
+    if(lua_pcall(L, 3, 1, 0) != LUA_OK){
+        luaL_error(L, "luaopen_luapython_core: Failed to get await function: %s", lua_tostring(L, -1));
+    }
+    lua_setfield(L, -2, "await");
+    pushPythonFunction(L, python_loop_fd);
+    lua_setfield(L, -2, "loop_fd");
+    pushPythonFunction(L, python_loop_step);
+    lua_setfield(L, -2, "loop_step");
+    pushPythonFunction(L, python_coroutine);
+    lua_setfield(L, -2, "coroutine");
     lua_pushcfunction(L, python_initialize);
     lua_setfield(L, -2, "initialize");
     lua_pushcfunction(L, python_finalize);
     lua_setfield(L, -2, "finalize");
     lua_pushcfunction(L, python_addr);
     lua_setfield(L, -2, "addr");
-    int d = tools_release_to_env;
+    int d = context->tools_release_to_env;
     return 1;
 }
 
 int luaopen_luapython_core_import(lua_State* L) {
-    lua_pushcfunction(L, python_import);
+    pushPythonFunction(L, python_import);
     return 1;
 }
@@ -1,12 +1,79 @@
-#define Py_LIMITED_API 0x03080000
+#include <pyconfig.h>
+
+// The free-threaded build (python3.13t) has no stable ABI, so it always uses the full API.
+#if defined(Py_GIL_DISABLED) && !defined(LUAPYTHON_LIMITED_API)
+#define LUAPYTHON_LIMITED_API 0
+#endif
+
+// Build against the stable ABI by default so one core.so works with whichever libpython is loaded.
+// Pass LUAPYTHON_LIMITED_API=0 (full API) or a newer version to unlock the optional fast paths below.
+#ifndef LUAPYTHON_LIMITED_API
+#define LUAPYTHON_LIMITED_API 0x03080000
+#endif
+
+#if LUAPYTHON_LIMITED_API
+#define Py_LIMITED_API LUAPYTHON_LIMITED_API
+#endif
 
 #include <Python.h>
+#include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
 #include "tools.h"
 
+// The buffer protocol joined the stable ABI in Python 3.11.
+#if !defined(Py_LIMITED_API) || Py_LIMITED_API >= 0x030b0000
+#define LUAPYTHON_HAS_BUFFER
+#endif
+
+// Vectorcall is public since 3.9 and part of the stable ABI since 3.12.
+#if (!defined(Py_LIMITED_API) && PY_VERSION_HEX >= 0x03090000) || (defined(Py_LIMITED_API) && Py_LIMITED_API >= 0x030c0000)
+#define LUAPYTHON_HAS_VECTORCALL
+#endif
+
+// Type version tags and _PyType_Lookup are only reachable outside the limited API. The cache is
+// shared by all threads, so it is left out of the free-threaded build.
+#if !defined(Py_LIMITED_API) && !defined(Py_GIL_DISABLED)
+#define LUAPYTHON_HAS_ATTR_CACHE
+#endif
+
+// PyDict_GetItemRef and PyList_GetItemRef (3.13) return new references. Without a GIL a borrowed
+// item can be freed by another thread before it is pushed, so they are used where available.
+#if PY_VERSION_HEX >= 0x030d0000 && (!defined(Py_LIMITED_API) || Py_LIMITED_API >= 0x030d0000)
+#define LUAPYTHON_HAS_ITEM_REF
+#endif
+
+// Walking a container must hold its per-object lock in the free-threaded build. The macros open
+// and close a block, so nothing may return or raise a Lua error between them.
+#if !defined(Py_LIMITED_API) && PY_VERSION_HEX >= 0x030d0000
+#define LUAPYTHON_BEGIN_CRITICAL_SECTION(obj) Py_BEGIN_CRITICAL_SECTION(obj)
+#define LUAPYTHON_BEGIN_CRITICAL_SECTION2(a, b) Py_BEGIN_CRITICAL_SECTION2(a, b)
+#define LUAPYTHON_END_CRITICAL_SECTION() Py_END_CRITICAL_SECTION()
+#define LUAPYTHON_END_CRITICAL_SECTION2() Py_END_CRITICAL_SECTION2()
+#else
+#define LUAPYTHON_BEGIN_CRITICAL_SECTION(obj) {
+#define LUAPYTHON_BEGIN_CRITICAL_SECTION2(a, b) {
+#define LUAPYTHON_END_CRITICAL_SECTION() }
+#define LUAPYTHON_END_CRITICAL_SECTION2() }
+#endif
+
+// Sub-interpreters with their own GIL need PyInterpreterConfig from the full 3.12 API.
+#if !defined(Py_LIMITED_API) && PY_VERSION_HEX >= 0x030c0000
+#define LUAPYTHON_HAS_SUBINTERPRETERS
+#endif
+
+// PyUnicode_AsUTF8AndSize (stable ABI since 3.10) reads the cached UTF-8 of a str without a copy.
+#if !defined(Py_LIMITED_API) || Py_LIMITED_API >= 0x030a0000
+#define LUAPYTHON_HAS_UTF8
+#endif
+
+// PyIter_Send (3.10) resumes a generator without a method call or a StopIteration object.
+#if (!defined(Py_LIMITED_API) && PY_VERSION_HEX >= 0x030a0000) || (defined(Py_LIMITED_API) && Py_LIMITED_API >= 0x030a0000)
+#define LUAPYTHON_HAS_ITER_SEND
+#endif
+
 #ifndef PREFIX
 #define PREFIX "/usr"
 #endif
@@ -22,23 +89,167 @@
 #define PYTHON_LIST_NAME "python_list"
 #define PYTHON_STRING_NAME "python_string"
 #define PYTHON_NUMBER_NAME "python_number"
+#define PYTHON_BUFFER_NAME "python_buffer"
+#define PYTHON_CALLSITE_NAME "python_callsite"
+#define PYTHON_SCHEMA_NAME "python_schema"
+#define PYTHON_COROUTINE_NAME "python_coroutine"
+#define PYTHON_CHANNEL_NAME "python_channel"
+#define PYTHON_SCOPE_NAME "python_scope"
+#define LUAPYTHON_KWARGS_NAME "luapython_kwargs"
 
 #define getPythonTypeName(obj) (PyBytes_AsString(PyUnicode_AsEncodedString(PyObject_GetAttrString((PyObject*)Py_TYPE(obj), "__name__"), "utf-8", "surrogateescape")))
 
-#define isPythonTuple(L, index) (isPythonObject(L, index) && PyTuple_Check(*(PyObject**)lua_touserdata(L, index)))
+// Every proxy userdata starts with this header. The kind tag replaces PyXxx_Check calls when
+// dispatching on the proxy type, size is the memory of the object reported to Lua's collector.
+typedef struct {
+    PyObject* obj;
+    int kind;
+    size_t size;
+} PythonProxy;
+
+enum {
+    PROXY_CLASS,
+    PROXY_MODULE,
+    PROXY_FUNCTION,
+    PROXY_ITER,
+    PROXY_SET,
+    PROXY_DICT,
+    PROXY_TUPLE,
+    PROXY_LIST,
+    PROXY_STRING,
+    PROXY_NUMBER,
+    PROXY_BUFFER,
+    PROXY_CALLSITE,
+    PROXY_COROUTINE,
+    PROXY_CHANNEL,
+    PROXY_SCHEMA,
+    PROXY_KIND_COUNT
+};
+
+#define toPythonProxy(L, index) ((PythonProxy*)lua_touserdata(L, index))
+#define isPythonKind(L, index, k) (isPythonObject(L, index) && toPythonProxy(L, index)->kind == (k))
+
+#define isPythonTuple(L, index) isPythonKind(L, index, PROXY_TUPLE)
 
 #if LUA_VERSION_NUM <= 501
 #define LUA_OK 0
 #endif
 
+#define CONVERT_CACHE_SIZE 256
+#define SIZE_CACHE_SIZE 64
+
+// Remembers the converter chosen for a type so pushLua classifies each type only once.
+// Entries hold a reference to their type so a cached address is never reused by another type.
+// For a registered converter, converter is its registry ref and base the kind of its argument.
+typedef struct {
+    PyTypeObject* type;
+    int kind;
+    int base;
+    int converter;
+} ConvertEntry;
+
+// Everything the binding keeps for one lua_State. Registry refs only mean something in the
+// state that created them, so several states can share the interpreter without seeing each
+// other's metatables.
+typedef struct {
+    int table_class_index;
+    int table_module_index;
+    int table_function_index;
+    int table_iter_index;
+    int table_set_index;
+    int table_dict_index;
+    int table_tuple_index;
+    int table_list_index;
+    int table_string_index;
+    int table_number_index;
+    int table_buffer_index;
+    int table_callsite_index;
+    int table_kwargs_index;
+    int table_coroutine_index;
+    int table_channel_index;
+    int table_scope_index;
+    int table_schema_index;
+    int tools_release_to_env;
+    int tools_get_iter_function;
+    int tools_get_await_function;
+    const void* proxy_metatables[PROXY_KIND_COUNT];
+    int converter_count;
+    ConvertEntry convert_cache[CONVERT_CACHE_SIZE];
+    PyObject* numbers_number;
+    PyObject* loop;
+    PyObject* executor;
+    int loop_flags;
+    PyObject* thread_future;
+    PyObject* channel_type;
+    PyThreadState* interpreter;
+    unsigned long gil_acquires;
+    double gil_wait;
+    double gil_max_wait;
+    PyObject** pending;
+    size_t pending_count;
+    size_t pending_capacity;
+    size_t gc_min_size;
+    double gc_pressure;
+    double gc_debt;
+    size_t gc_limit;
+    size_t gc_next_collect;
+    size_t gc_external;
+    int scope_threads;
+    int scope_count;
+    ConvertEntry size_cache[SIZE_CACHE_SIZE];
+} PythonContext;
+
+PythonContext* getPythonContext(lua_State* L);
+void releaseContextPython(PythonContext* context);
+void clearConvertCache(PythonContext* context);
+void clearSizeCache(PythonContext* context);
+
 int luaopen_luapython(lua_State* L);
 
 int python_tostring(lua_State* L);
 int python_gc(lua_State* L);
 int python_index(lua_State* L);
 int python_newindex(lua_State* L);
+int python_prepare(lua_State* L);
+int python_submit(lua_State* L);
+int python_pmap(lua_State* L);
+int python_channel(lua_State* L);
+int python_gc_policy(lua_State* L);
+int python_scope(lua_State* L);
+int python_release(lua_State* L);
+int python_schema(lua_State* L);
+int python_columns(lua_State* L);
+int python_kw(lua_State* L);
+int python_register_converter(lua_State* L);
+int python_release_gil(lua_State* L);
+int python_with_gil(lua_State* L);
+int python_gil_stats(lua_State* L);
+int async_schedule(lua_State* L);
+int async_step(lua_State* L);
+int async_finish(lua_State* L);
+int python_loop_fd(lua_State* L);
+int python_loop_step(lua_State* L);
+int python_coroutine(lua_State* L);
+
+void pushPythonFunction(lua_State* L, lua_CFunction function);
+void releaseLater(PythonContext* context, PyObject* obj);
+void releasePending(PythonContext* context);
+void holdGIL(void);
+void restoreGIL(void);
+#ifdef LUAPYTHON_HAS_SUBINTERPRETERS
+void startInterpreter(lua_State* L);
+void stopInterpreter(PythonContext* context);
+#endif
+void disableAttrCache(void);
+void clearAttrCache(void);
 
+int isPythonProxy(lua_State* L, int index);
 int isPythonObject(lua_State* L, int index);
+size_t sizeOfPython(PythonContext* context, PyObject* obj);
+void accountLua(lua_State* L, PythonProxy* proxy, size_t size);
+void unaccountLua(PythonContext* context, PythonProxy* proxy);
+void settleGCLua(lua_State* L, PythonContext* context);
+void registerProxyMetatable(lua_State* L, int kind);
 
 int pushNumberLua(lua_State* L, PyObject* number);
 int pushStringLua(lua_State* L, PyObject* string);
@@ -50,8 +261,16 @@ int pushFunctionLua(lua_State* L, PyObject* function);
 int pushModuleLua(lua_State* L, PyObject* module);
 int pushClassLua(lua_State* L, PyObject* obj);
 int pushIterLua(lua_State* L, PyObject* iter);
+#ifdef LUAPYTHON_HAS_BUFFER
+int pushBufferLua(lua_State* L, PyObject* obj);
+void releaseBufferView(PythonContext* context, PythonProxy* proxy);
+#endif
 
 int pushLua(lua_State* L, PyObject* obj);
+void pushUtf8Lua(lua_State* L, PyObject* str);
+int pushCachedLua(lua_State* L, PyObject* obj, int metatable);
+void cacheLua(lua_State* L, PyObject* obj);
+void uncacheLua(lua_State* L, PyObject* obj, int index);
 
 PyObject* convertNumberPython(lua_State* L, int index);
 PyObject* convertBooleanPython(lua_State* L, int index);
@@ -64,3 +283,12 @@ PyObject* convertFunctionPython(lua_State* L, int index);
 PyObject* convertModulePython(lua_State* L, int index);
 
 PyObject* convertPython(lua_State* L, int index);
+PyObject* tryConvertPython(lua_State* L, int index);
+int matchesKind(lua_State* L, char kind, int index);
+PyObject* convertKindPython(lua_State* L, char kind, int index);
+char checkKind(lua_State* L, int index, const char* caller);
+PyObject* internStringPython(lua_State* L, int index);
+PyObject* getAttrPython(PyObject* obj, PyObject* name);
+PyObject* getLoopPython(lua_State* L);
+PyObject* getExecutorPython(lua_State* L);
+int stepLoopPython(PyObject* loop);
@@ -0,0 +1,129 @@
+#include "luapython.h"
+
+// A proxy is a few bytes to Lua's collector while the object behind it may own gigabytes, so
+// unreachable arrays could linger until a full collection happens by chance. Proxies of objects
+// owning at least gc_min_size bytes record that size, make the collector do the work it would do
+// for an allocation of that size (times gc_pressure), and force a full collection once the
+// recorded sizes of a state pass gc_limit. The work is done by settleGCLua once the call that
+// pushed the proxies has returned: a step runs finalizers, which must not happen in the middle of
+// a conversion.
+
+// Only types that override __sizeof__ report more than their fixed header, so the check is
+// done once per type.
+static int hasSizeofPython(PythonContext* context, PyTypeObject* type) {
+    ConvertEntry* entry = &context->size_cache[((size_t)type >> 4) % SIZE_CACHE_SIZE];
+    if (entry->type != type) {
+        PyObject* own = PyObject_GetAttrString((PyObject*)type, "__sizeof__");
+        PyObject* base = PyObject_GetAttrString((PyObject*)&PyBaseObject_Type, "__sizeof__");
+        if (own == NULL || base == NULL) {
+            PyErr_Clear();
+        }
+        Py_INCREF((PyObject*)type);
+        Py_XDECREF((PyObject*)entry->type);
+        entry->type = type;
+        entry->kind = own != NULL && own != base;
+        Py_XDECREF(own);
+        Py_XDECREF(base);
+    }
+    return entry->kind;
+}
+
+void clearSizeCache(PythonContext* context) {
+    for (int i = 0; i < SIZE_CACHE_SIZE; i++) {
+        Py_XDECREF((PyObject*)context->size_cache[i].type);
+        context->size_cache[i].type = NULL;
+    }
+}
+
+// Estimated bytes owned by obj, as sys.getsizeof reports them, or 0 when not worth asking.
+size_t sizeOfPython(PythonContext* context, PyObject* obj) {
+    if (context->gc_pressure <= 0 && context->gc_limit == 0) {
+        return 0;
+    }
+    if (PyList_Check(obj)) {
+        return (size_t)PyList_Size(obj) * sizeof(PyObject*);
+    }
+    if (PyDict_Check(obj)) {
+        return (size_t)PyDict_Size(obj) * 3 * sizeof(PyObject*);
+    }
+    if (!hasSizeofPython(context, Py_TYPE(obj))) {
+        return 0;
+    }
+    PyObject* result = PyObject_CallMethod(obj, "__sizeof__", NULL);
+    size_t size = result ? PyLong_AsSize_t(result) : 0;
+    Py_XDECREF(result);
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+        size = 0;
+    }
+    return size;
+}
+
+// Records size for the new proxy on top of the stack and the collector work it asks for.
+void accountLua(lua_State* L, PythonProxy* proxy, size_t size) {
+    PythonContext* context = getPythonContext(L);
+    if (size < context->gc_min_size || size == 0) {
+        return;
+    }
+    proxy->size = size;
+    context->gc_external += size;
+    if (context->gc_pressure > 0) {
+        context->gc_debt += (double)size * context->gc_pressure / 1024;
+    }
+}
+
+// Lets the collector catch up with what accountLua recorded. Called by the GIL wrapper after a
+// function returned, when its results are on the stack and nothing is half converted.
+void settleGCLua(lua_State* L, PythonContext* context) {
+    if (context->gc_limit > 0 && context->gc_external >= context->gc_next_collect) {
+        context->gc_debt = 0;
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        // What is still alive is not collected by the next call either, so wait for it to double.
+        size_t next = context->gc_external * 2;
+        context->gc_next_collect = next > context->gc_limit ? next : context->gc_limit;
+    } else if (context->gc_debt >= 1) {
+        double kb = context->gc_debt;
+        context->gc_debt = 0;
+        lua_gc(L, LUA_GCSTEP, kb > INT_MAX ? INT_MAX : (int)kb);
+    }
+}
+
+void unaccountLua(PythonContext* context, PythonProxy* proxy) {
+    context->gc_external -= proxy->size;
+    proxy->size = 0;
+}
+
+// luapython.gc_policy{min_size=, pressure=, limit=} updates the given fields and returns the
+// policy with the bytes currently accounted as external.
+int python_gc_policy(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "min_size");
+        if (!lua_isnil(L, -1)) {
+            context->gc_min_size = (size_t)luaL_checknumber(L, -1);
+        }
+        lua_getfield(L, 1, "pressure");
+        if (!lua_isnil(L, -1)) {
+            context->gc_pressure = luaL_checknumber(L, -1);
+        }
+        lua_getfield(L, 1, "limit");
+        if (!lua_isnil(L, -1)) {
+            context->gc_limit = (size_t)luaL_checknumber(L, -1);
+            context->gc_next_collect = context->gc_limit;
+        }
+        lua_pop(L, 3);
+    } else if (!lua_isnoneornil(L, 1)) {
+        luaL_error(L, "python_gc_policy: Policy table expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, (lua_Integer)context->gc_min_size);
+    lua_setfield(L, -2, "min_size");
+    lua_pushnumber(L, context->gc_pressure);
+    lua_setfield(L, -2, "pressure");
+    lua_pushinteger(L, (lua_Integer)context->gc_limit);
+    lua_setfield(L, -2, "limit");
+    lua_pushinteger(L, (lua_Integer)context->gc_external);
+    lua_setfield(L, -2, "external");
+    return 1;
+}
@@ -7,8 +7,11 @@ int module_index(lua_State* L) {
     }
     const char* key = lua_tostring(L, -1);
     PyObject* module = convertPython(L, -2);
-    PyObject* value = PyObject_GetAttrString(module, key);
+    PyObject* name = lua_type(L, -1) == LUA_TSTRING ? internStringPython(L, -1) : convertStringPython(L, -1);
+    PyObject* value = name ? PyObject_GetAttr(module, name) : NULL;
+    Py_XDECREF(name);
     if (value == NULL) {
+        PyErr_Clear();
         const char* moduleName = getPythonTypeName(module);
         Py_XDECREF(module);
         Py_XDECREF(value);
@@ -34,29 +37,35 @@ int module_tostring(lua_State* L) {
     return 1;
 }
 
-int table_module_index = 0;
-
 int pushModuleLua(lua_State* L, PyObject* obj) {
-    if (table_module_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = obj;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_module_index);
+    PythonContext* context = getPythonContext(L);
+    if (context->table_module_index != 0) {
+        if (pushCachedLua(L, obj, context->table_module_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = obj;
+        proxy->kind = PROXY_MODULE;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_module_index);
         if (!lua_istable(L, -1)) {
             luaL_error(L, "pushModuleLua: Internal error, class index is a %s", luaL_typename(L, -1));
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, obj);
         return 1;
     }
     lua_createtable(L, 0, 4);
-    lua_pushcfunction(L, module_index);
+    pushPythonFunction(L, module_index);
     lua_setfield(L, -2, "__index");
     lua_pushstring(L, PYTHON_MODULE_NAME);
     lua_setfield(L, -2, "__name");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
-    lua_pushcfunction(L, python_tostring);
+    pushPythonFunction(L, python_tostring);
     lua_setfield(L, -2, "__tostring");
-    table_module_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_MODULE);
+    context->table_module_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushModuleLua(L, obj);
 }
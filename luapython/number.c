@@ -1,6 +1,6 @@
 #include "luapython.h"
 
-#define isPythonNumber(L, index) (isPythonObject(L, index) && PyNumber_Check(*(PyObject**)lua_touserdata(L, index)))
+#define isPythonNumber(L, index) isPythonKind(L, index, PROXY_NUMBER)
 
 int number_add(lua_State* L) {
     if (!lua_isnumber(L, -1) && !isPythonNumber(L, -1)) {
@@ -805,9 +805,8 @@ int number_tostring(lua_State* L) {
     return 1;
 }
 
-int table_number_index = 0;
-
 int pushNumberLua(lua_State* L, PyObject* obj) {
+    PythonContext* context = getPythonContext(L);
     if (!PyNumber_Check(obj)) {
         luaL_error(L, "pushNumberLua: Failed to set metatable for number");
         return 0;
@@ -825,65 +824,72 @@ int pushNumberLua(lua_State* L, PyObject* obj) {
             return 1;
         }
     }
-    if (table_number_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = obj;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_number_index);
+    if (context->table_number_index != 0) {
+        if (pushCachedLua(L, obj, context->table_number_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = obj;
+        proxy->kind = PROXY_NUMBER;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_number_index);
         if (!lua_istable(L, -1)) {
             luaL_error(L, "pushNumberLua: Internal error, class index is not a table");
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, obj);
         return 1;
     }
     lua_createtable(L, 0, 23);
-    lua_pushcfunction(L, number_add);
+    pushPythonFunction(L, number_add);
     lua_setfield(L, -2, "__add");
-    lua_pushcfunction(L, number_sub);
+    pushPythonFunction(L, number_sub);
     lua_setfield(L, -2, "__sub");
-    lua_pushcfunction(L, number_mul);
+    pushPythonFunction(L, number_mul);
     lua_setfield(L, -2, "__mul");
-    lua_pushcfunction(L, number_div);
+    pushPythonFunction(L, number_div);
     lua_setfield(L, -2, "__div");
-    lua_pushcfunction(L, number_mod);
+    pushPythonFunction(L, number_mod);
     lua_setfield(L, -2, "__mod");
-    lua_pushcfunction(L, number_pow);
+    pushPythonFunction(L, number_pow);
     lua_setfield(L, -2, "__pow");
-    lua_pushcfunction(L, number_unm);
+    pushPythonFunction(L, number_unm);
     lua_setfield(L, -2, "__unm");
-    lua_pushcfunction(L, number_idiv);
+    pushPythonFunction(L, number_idiv);
     lua_setfield(L, -2, "__idiv");
-    lua_pushcfunction(L, number_band);
+    pushPythonFunction(L, number_band);
     lua_setfield(L, -2, "__band");
-    lua_pushcfunction(L, number_bor);
+    pushPythonFunction(L, number_bor);
     lua_setfield(L, -2, "__bor");
-    lua_pushcfunction(L, number_bxor);
+    pushPythonFunction(L, number_bxor);
     lua_setfield(L, -2, "__bxor");
-    lua_pushcfunction(L, number_bnot);
+    pushPythonFunction(L, number_bnot);
     lua_setfield(L, -2, "__bnot");
-    lua_pushcfunction(L, number_shl);
+    pushPythonFunction(L, number_shl);
     lua_setfield(L, -2, "__shl");
-    lua_pushcfunction(L, number_shr);
+    pushPythonFunction(L, number_shr);
     lua_setfield(L, -2, "__shr");
-    lua_pushcfunction(L, number_concat);
+    pushPythonFunction(L, number_concat);
     lua_setfield(L, -2, "__concat");
-    lua_pushcfunction(L, number_len);
+    pushPythonFunction(L, number_len);
     lua_setfield(L, -2, "__len");
-    lua_pushcfunction(L, number_eq);
+    pushPythonFunction(L, number_eq);
     lua_setfield(L, -2, "__eq");
-    lua_pushcfunction(L, number_lt);
+    pushPythonFunction(L, number_lt);
     lua_setfield(L, -2, "__lt");
-    lua_pushcfunction(L, number_le);
+    pushPythonFunction(L, number_le);
     lua_setfield(L, -2, "__le");
-    lua_pushcfunction(L, number_tostring);
+    pushPythonFunction(L, number_tostring);
     lua_setfield(L, -2, "__tostring");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
     lua_pushstring(L, PYTHON_NUMBER_NAME);
     lua_setfield(L, -2, "__name");
-    lua_pushcfunction(L, python_index);
+    pushPythonFunction(L, python_index);
     lua_setfield(L, -2, "__index");
-    table_number_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_NUMBER);
+    context->table_number_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushNumberLua(L, obj);
 }
 
@@ -0,0 +1,221 @@
+#include "luapython.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+// luapython.pmap(fn, array, {workers=N, chunk=K}) maps fn over a Lua array on forked worker
+// processes, so CPU-bound Python code is not held back by the GIL. The workers inherit the
+// arguments through fork instead of receiving pickles: an array of numbers is copied into an
+// anonymous shared mapping, anything else is converted once with convertListPython. Results
+// that are floats or machine integers come back through the same mapping and are pushed without
+// a Python object, only other objects are pickled back to the parent.
+
+#define PMAP_MODULE "_luapython_pmap"
+
+// PyMemoryView_FromMemory is in the stable ABI since 3.3, its flag only got declared in 3.11.
+#ifndef PyBUF_WRITE
+#define PyBUF_WRITE 0x200
+#endif
+
+// Input slots (8 bytes, only for numeric arrays), then result slots (8 bytes), then one kind
+// byte per result: 0 float, 1 integer, 2 object returned by the chunk.
+static const char* pmap_source =
+    "import multiprocessing\n"
+    "_job = None\n"
+    "def _chunk(bounds):\n"
+    "    fn, values, floats, ints, kinds = _job\n"
+    "    objects = None\n"
+    "    for i in range(bounds[0], bounds[1]):\n"
+    "        r = fn(values[i])\n"
+    "        t = type(r)\n"
+    "        if t is float:\n"
+    "            floats[i] = r\n"
+    "            kinds[i] = 0\n"
+    "        elif t is int and -0x8000000000000000 <= r <= 0x7fffffffffffffff:\n"
+    "            ints[i] = r\n"
+    "            kinds[i] = 1\n"
+    "        else:\n"
+    "            if objects is None:\n"
+    "                objects = {}\n"
+    "            objects[i] = r\n"
+    "            kinds[i] = 2\n"
+    "    return objects\n"
+    "def run(fn, memory, n, fmt, items, workers, chunk):\n"
+    "    global _job\n"
+    "    offset = 8 * n if fmt else 0\n"
+    "    values = memory[:offset].cast(fmt) if fmt else items\n"
+    "    results = memory[offset:offset + 8 * n]\n"
+    "    _job = (fn, values, results.cast('d'), results.cast('q'), memory[offset + 8 * n:])\n"
+    "    try:\n"
+    "        bounds = [(i, min(i + chunk, n)) for i in range(0, n, chunk)]\n"
+    "        with multiprocessing.get_context('fork').Pool(workers) as pool:\n"
+    "            return pool.map(_chunk, bounds, 1)\n"
+    "    finally:\n"
+    "        _job = None\n";
+
+// Returns the helper module (new reference), compiling it on first use in this interpreter.
+static PyObject* getPmapModule(void) {
+    PyObject* modules = PyImport_GetModuleDict();
+    PyObject* module = PyDict_GetItemString(modules, PMAP_MODULE);
+    if (module) {
+        Py_INCREF(module);
+        return module;
+    }
+    PyObject* code = Py_CompileString(pmap_source, PMAP_MODULE, Py_file_input);
+    if (code == NULL) {
+        return NULL;
+    }
+    module = PyImport_ExecCodeModule(PMAP_MODULE, code);
+    Py_DECREF(code);
+    return module;
+}
+
+static lua_Integer getOption(lua_State* L, int index, const char* name, lua_Integer fallback) {
+    if (!lua_istable(L, index)) {
+        return fallback;
+    }
+    lua_getfield(L, index, name);
+    lua_Integer value = lua_isnil(L, -1) ? fallback : luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    if (value < 1) {
+        luaL_error(L, "python_pmap: %s must be positive", name);
+    }
+    return value;
+}
+
+// Input format of the array: 'q' for integers, 'd' for floats, 0 when it needs conversion.
+// Mixed arrays are converted so every element keeps the type convertNumberPython gives it.
+static char numericFormat(lua_State* L, int index, size_t n) {
+    char fmt = 0;
+    for (size_t i = 1; i <= n; i++) {
+        lua_rawgeti(L, index, (lua_Integer)i);
+        char kind = 0;
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+#if LUA_VERSION_NUM >= 503
+            kind = lua_isinteger(L, -1) ? 'q' : 'd';
+#else
+            kind = 'd';
+#endif
+        }
+        lua_pop(L, 1);
+        if (kind == 0 || (fmt != 0 && kind != fmt)) {
+            return 0;
+        }
+        fmt = kind;
+    }
+    return fmt;
+}
+
+static int pushResultsLua(lua_State* L, PyObject* chunks, const char* results, const char* kinds, size_t n,
+                          size_t chunk) {
+    lua_createtable(L, (int)n, 0);
+    for (size_t i = 0; i < n; i++) {
+        if (kinds[i] == 0) {
+            double value;
+            memcpy(&value, results + 8 * i, 8);
+            lua_pushnumber(L, value);
+        } else if (kinds[i] == 1) {
+            long long value;
+            memcpy(&value, results + 8 * i, 8);
+            lua_pushinteger(L, (lua_Integer)value);
+        } else {
+            PyObject* objects = PyList_GetItem(chunks, (Py_ssize_t)(i / chunk));
+            PyObject* key = PyLong_FromSize_t(i);
+            PyObject* value = objects && key ? PyDict_GetItem(objects, key) : NULL;
+            Py_XDECREF(key);
+            if (value == NULL) {
+                lua_pop(L, 1);
+                return 0;
+            }
+            Py_INCREF(value);
+            pushLua(L, value);
+        }
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    return 1;
+}
+
+int python_pmap(lua_State* L) {
+    if (!isPythonObject(L, 1) || !PyCallable_Check(toPythonProxy(L, 1)->obj)) {
+        luaL_error(L, "python_pmap: Attempt to map a %s value", luaL_typename(L, 1));
+        return 0;
+    }
+    if (!lua_istable(L, 2)) {
+        luaL_error(L, "python_pmap: Array expected, got %s", luaL_typename(L, 2));
+        return 0;
+    }
+#if LUA_VERSION_NUM >= 502
+    size_t n = lua_rawlen(L, 2);
+#else
+    size_t n = lua_objlen(L, 2);
+#endif
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    lua_Integer workers = getOption(L, 3, "workers", cpus > 0 ? cpus : 1);
+    lua_Integer chunk = getOption(L, 3, "chunk", n / (workers * 4) + 1);
+    if (n == 0) {
+        lua_newtable(L);
+        return 1;
+    }
+    char fmt = numericFormat(L, 2, n);
+    PyObject* items = NULL;
+    if (!fmt) {
+        items = convertListPython(L, 2);
+        if (items == NULL) {
+            luaL_error(L, "python_pmap: Failed to convert the array");
+            return 0;
+        }
+    }
+    size_t input_size = fmt ? 8 * n : 0;
+    size_t size = input_size + 9 * n;
+    char* memory = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        Py_XDECREF(items);
+        luaL_error(L, "python_pmap: Failed to map %d bytes of shared memory", (int)size);
+        return 0;
+    }
+    for (size_t i = 0; fmt && i < n; i++) {
+        lua_rawgeti(L, 2, (lua_Integer)i + 1);
+        if (fmt == 'q') {
+            long long value = (long long)lua_tointeger(L, -1);
+            memcpy(memory + 8 * i, &value, 8);
+        } else {
+            double value = (double)lua_tonumber(L, -1);
+            memcpy(memory + 8 * i, &value, 8);
+        }
+        lua_pop(L, 1);
+    }
+    PyObject* module = getPmapModule();
+    PyObject* view = PyMemoryView_FromMemory(memory, (Py_ssize_t)size, PyBUF_WRITE);
+    PyObject* chunks = NULL;
+    if (module && view) {
+        chunks = PyObject_CallMethod(module, "run", "OOnsOnn", toPythonProxy(L, 1)->obj, view, (Py_ssize_t)n,
+                                     fmt ? (fmt == 'q' ? "q" : "d") : NULL, items ? items : Py_None,
+                                     (Py_ssize_t)workers, (Py_ssize_t)chunk);
+    }
+    if (chunks == NULL) {
+        PyErr_Print();
+    }
+    if (view) {
+        // The mapping is unmapped below, so the view must not be usable afterwards.
+        PyObject* released = PyObject_CallMethod(view, "release", NULL);
+        if (released == NULL) {
+            PyErr_Clear();
+        }
+        Py_XDECREF(released);
+    }
+    Py_XDECREF(view);
+    Py_XDECREF(module);
+    Py_XDECREF(items);
+    if (chunks == NULL) {
+        munmap(memory, size);
+        luaL_error(L, "python_pmap: Mapping failed");
+        return 0;
+    }
+    int pushed = pushResultsLua(L, chunks, memory + input_size, memory + input_size + 8 * n, n, (size_t)chunk);
+    Py_DECREF(chunks);
+    munmap(memory, size);
+    if (!pushed) {
+        luaL_error(L, "python_pmap: Workers returned incomplete results");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,410 @@
+#include "luapython.h"
+
+// luapython.schema{{"id", "integer"}, {"score", "number"}, "label", target=Row} compiles a record
+// shape once: the field names are kept as Lua strings and as interned Python strings, each field
+// has a conversion kind as in luapython.prepare, and target is "dict" (the default), "tuple" or a
+// callable such as a dataclass or namedtuple that takes the fields positionally in order.
+// Converting a record then reads and writes fixed keys in a loop, without walking the table or
+// creating key strings.
+
+#define isPythonSchema(L, index) isPythonKind(L, index, PROXY_SCHEMA)
+
+#define SCHEMA_STACK_FIELDS 16
+
+// proxy.obj is the target: PyDict_Type, PyTuple_Type or the callable.
+typedef struct {
+    PythonProxy proxy;
+    int names;
+    int count;
+    char* kinds;
+    PyObject* keys[1];
+} PythonSchema;
+
+static PythonSchema* checkSchema(lua_State* L, const char* caller) {
+    if (!isPythonSchema(L, 1)) {
+        luaL_error(L, "%s: Python schema expected, got %s", caller, luaL_typename(L, 1));
+        return NULL;
+    }
+    return (PythonSchema*)lua_touserdata(L, 1);
+}
+
+static PyObject** allocFields(lua_State* L, PyObject** stack, int count) {
+    if (count <= SCHEMA_STACK_FIELDS) {
+        return stack;
+    }
+    return (PyObject**)lua_newuserdata(L, sizeof(PyObject*) * count);
+}
+
+// Converts the record table at index into a new reference, or NULL after releasing what was
+// converted. A field that does not match its kind sets mismatch to its name, other failures leave
+// a Python error. values is scratch space for count fields, names the index of the name table.
+static PyObject* convertRecordPython(lua_State* L, PythonSchema* schema, int index, int names, PyObject** values,
+                                     const char** mismatch) {
+    *mismatch = NULL;
+    for (int i = 0; i < schema->count; i++) {
+        lua_rawgeti(L, names, i + 1);
+        lua_rawget(L, index);
+        char kind = schema->kinds[i];
+        int matches = 1;
+        if (lua_isnil(L, -1)) {
+            Py_INCREF(Py_None);
+            values[i] = Py_None;
+        } else if (!matchesKind(L, kind, -1)) {
+            values[i] = NULL;
+            matches = 0;
+        } else {
+            values[i] = convertKindPython(L, kind, -1);
+        }
+        lua_pop(L, 1);
+        if (values[i] == NULL) {
+            for (int j = 0; j < i; j++) {
+                Py_DECREF(values[j]);
+            }
+            if (!matches) {
+                // The name table keeps the string alive for the caller.
+                lua_rawgeti(L, names, i + 1);
+                *mismatch = lua_tostring(L, -1);
+                lua_pop(L, 1);
+            }
+            return NULL;
+        }
+    }
+    PyObject* target = schema->proxy.obj;
+    PyObject* result;
+    if (target == (PyObject*)&PyDict_Type) {
+        result = PyDict_New();
+        for (int i = 0; i < schema->count; i++) {
+            if (result && PyDict_SetItem(result, schema->keys[i], values[i]) != 0) {
+                Py_CLEAR(result);
+            }
+            Py_DECREF(values[i]);
+        }
+        return result;
+    }
+    if (target == (PyObject*)&PyTuple_Type) {
+        result = PyTuple_New(schema->count);
+        for (int i = 0; i < schema->count; i++) {
+            if (result) {
+                PyTuple_SetItem(result, i, values[i]);
+            } else {
+                Py_DECREF(values[i]);
+            }
+        }
+        return result;
+    }
+#ifdef LUAPYTHON_HAS_VECTORCALL
+    result = PyObject_Vectorcall(target, values, schema->count, NULL);
+#else
+    PyObject* args = PyTuple_New(schema->count);
+    for (int i = 0; args && i < schema->count; i++) {
+        Py_INCREF(values[i]);
+        PyTuple_SetItem(args, i, values[i]);
+    }
+    result = args ? PyObject_Call(target, args, NULL) : NULL;
+    Py_XDECREF(args);
+#endif
+    for (int i = 0; i < schema->count; i++) {
+        Py_DECREF(values[i]);
+    }
+    return result;
+}
+
+// Pushes the fields of obj as a Lua record. Dicts are read by key, tuples (namedtuples too) by
+// position and other objects by attribute. Returns 0, or -1 with a Python error set and nothing
+// pushed when a field cannot be read or does not match its kind, setting field to its name.
+static int pushRecordLua(lua_State* L, PythonSchema* schema, PyObject* obj, int names, const char** field) {
+    int mode = PyDict_Check(obj) ? 'd' : PyTuple_Check(obj) ? 't' : 'a';
+    Py_ssize_t size = mode == 't' ? PyTuple_Size(obj) : 0;
+    lua_createtable(L, 0, schema->count);
+    for (int i = 0; i < schema->count; i++) {
+        PyObject* value;
+        if (mode == 'd') {
+#ifdef LUAPYTHON_HAS_ITEM_REF
+            if (PyDict_GetItemRef(obj, schema->keys[i], &value) < 0) {
+                PyErr_Clear();
+            }
+#else
+            value = PyDict_GetItem(obj, schema->keys[i]);
+            Py_XINCREF(value);
+#endif
+        } else if (mode == 't') {
+            value = i < size ? PyTuple_GetItem(obj, i) : NULL;
+            Py_XINCREF(value);
+        } else {
+            value = PyObject_GetAttr(obj, schema->keys[i]);
+            if (value == NULL) {
+                lua_pop(L, 1);
+                // The name table keeps the string alive for the caller.
+                lua_rawgeti(L, names, i + 1);
+                *field = lua_tostring(L, -1);
+                lua_pop(L, 1);
+                return -1;
+            }
+        }
+        if (value == NULL || Py_IsNone(value)) {
+            Py_XDECREF(value);
+            continue;
+        }
+        lua_rawgeti(L, names, i + 1);
+        switch (schema->kinds[i]) {
+        case 'n':
+            lua_pushnumber(L, PyFloat_AsDouble(value));
+            break;
+        case 'i':
+            lua_pushinteger(L, (lua_Integer)PyLong_AsLongLong(value));
+            break;
+        case 's':
+            if (PyUnicode_Check(value)) {
+                pushUtf8Lua(L, value);
+            } else {
+                lua_pushnil(L);
+            }
+            break;
+        case 'b':
+            lua_pushboolean(L, PyObject_IsTrue(value) == 1);
+            break;
+        default:
+            Py_INCREF(value);
+            pushLua(L, value);
+            break;
+        }
+        Py_DECREF(value);
+        if (PyErr_Occurred()) {
+            *field = lua_tostring(L, -2);
+            lua_pop(L, 3);
+            return -1;
+        }
+        lua_rawset(L, -3);
+    }
+    return 0;
+}
+
+// schema(record) -> Python object
+int schema_call(lua_State* L) {
+    PythonSchema* schema = checkSchema(L, "schema_call");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, schema->names);
+    PyObject* stack[SCHEMA_STACK_FIELDS];
+    PyObject** values = allocFields(L, stack, schema->count);
+    const char* mismatch;
+    PyObject* result = convertRecordPython(L, schema, 2, 3, values, &mismatch);
+    if (result == NULL) {
+        if (mismatch) {
+            luaL_error(L, "schema_call: Field %s does not match its kind", mismatch);
+            return 0;
+        }
+        PyErr_Print();
+        luaL_error(L, "schema_call: Failed to build the record");
+        return 0;
+    }
+    pushLua(L, result);
+    return 1;
+}
+
+// schema:list(records) -> Python list with one object per record of the Lua array
+int schema_list(lua_State* L) {
+    PythonSchema* schema = checkSchema(L, "schema_list");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, schema->names);
+    PyObject* stack[SCHEMA_STACK_FIELDS];
+    PyObject** values = allocFields(L, stack, schema->count);
+#if LUA_VERSION_NUM >= 502
+    lua_Integer len = (lua_Integer)lua_rawlen(L, 2);
+#else
+    lua_Integer len = (lua_Integer)lua_objlen(L, 2);
+#endif
+    PyObject* list = PyList_New(len);
+    if (list == NULL) {
+        PyErr_Print();
+        luaL_error(L, "schema_list: Failed to create the list");
+        return 0;
+    }
+    for (lua_Integer i = 1; i <= len; i++) {
+        lua_rawgeti(L, 2, i);
+        if (!lua_istable(L, -1)) {
+            Py_DECREF(list);
+            luaL_error(L, "schema_list: Record %d is a %s value", (int)i, luaL_typename(L, -1));
+            return 0;
+        }
+        const char* mismatch;
+        PyObject* item = convertRecordPython(L, schema, lua_gettop(L), 3, values, &mismatch);
+        lua_pop(L, 1);
+        if (item == NULL) {
+            Py_DECREF(list);
+            if (mismatch) {
+                luaL_error(L, "schema_list: Field %s of record %d does not match its kind", mismatch, (int)i);
+                return 0;
+            }
+            PyErr_Print();
+            luaL_error(L, "schema_list: Failed to build record %d", (int)i);
+            return 0;
+        }
+        PyList_SetItem(list, i - 1, item);
+    }
+    pushLua(L, list);
+    return 1;
+}
+
+// schema:record(obj) -> Lua table with the fields of obj
+int schema_record(lua_State* L) {
+    PythonSchema* schema = checkSchema(L, "schema_record");
+    if (!isPythonObject(L, 2)) {
+        luaL_error(L, "schema_record: Python object expected, got %s", luaL_typename(L, 2));
+        return 0;
+    }
+    lua_settop(L, 2);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, schema->names);
+    const char* field;
+    if (pushRecordLua(L, schema, toPythonProxy(L, 2)->obj, 3, &field) != 0) {
+        PyErr_Print();
+        luaL_error(L, "schema_record: Failed to read field %s", field);
+        return 0;
+    }
+    return 1;
+}
+
+// schema:records(iterable) -> Lua array of records
+int schema_records(lua_State* L) {
+    PythonSchema* schema = checkSchema(L, "schema_records");
+    if (!isPythonObject(L, 2)) {
+        luaL_error(L, "schema_records: Python iterable expected, got %s", luaL_typename(L, 2));
+        return 0;
+    }
+    lua_settop(L, 2);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, schema->names);
+    PyObject* obj = toPythonProxy(L, 2)->obj;
+    Py_ssize_t size = PyList_Check(obj) ? PyList_Size(obj) : PyTuple_Check(obj) ? PyTuple_Size(obj) : 0;
+    PyObject* iter = PyObject_GetIter(obj);
+    if (iter == NULL) {
+        PyErr_Print();
+        luaL_error(L, "schema_records: Python iterable expected, got %s", getPythonTypeName(obj));
+        return 0;
+    }
+    lua_createtable(L, (int)size, 0);
+    PyObject* item;
+    lua_Integer count = 0;
+    const char* field = NULL;
+    while ((item = PyIter_Next(iter)) != NULL) {
+        int status = pushRecordLua(L, schema, item, 3, &field);
+        Py_DECREF(item);
+        if (status != 0) {
+            break;
+        }
+        lua_rawseti(L, -2, ++count);
+    }
+    Py_DECREF(iter);
+    if (field) {
+        PyErr_Print();
+        luaL_error(L, "schema_records: Failed to read field %s of record %d", field, (int)count + 1);
+        return 0;
+    }
+    if (PyErr_Occurred()) {
+        PyErr_Print();
+        luaL_error(L, "schema_records: Iteration raised an exception");
+        return 0;
+    }
+    return 1;
+}
+
+int schema_gc(lua_State* L) {
+    PythonSchema* schema = (PythonSchema*)lua_touserdata(L, 1);
+    PythonContext* context = getPythonContext(L);
+    for (int i = 0; i < schema->count; i++) {
+        releaseLater(context, schema->keys[i]);
+        schema->keys[i] = NULL;
+    }
+    releaseLater(context, schema->proxy.obj);
+    schema->proxy.obj = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, schema->names);
+    schema->names = LUA_NOREF;
+    return 0;
+}
+
+// luapython.schema{field, ..., target=} where a field is "name" or {"name", "kind"}
+int python_schema(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    if (!lua_istable(L, 1)) {
+        luaL_error(L, "python_schema: Shape table expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    lua_settop(L, 1);
+    lua_getfield(L, 1, "target");
+    PyObject* target = NULL;
+    if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "dict") == 0)) {
+        target = (PyObject*)&PyDict_Type;
+    } else if (lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "tuple") == 0) {
+        target = (PyObject*)&PyTuple_Type;
+    } else if (isPythonObject(L, -1) && PyCallable_Check(toPythonProxy(L, -1)->obj)) {
+        target = toPythonProxy(L, -1)->obj;
+    } else {
+        luaL_error(L, "python_schema: target must be \"dict\", \"tuple\" or a Python callable");
+        return 0;
+    }
+#if LUA_VERSION_NUM >= 502
+    int count = (int)lua_rawlen(L, 1);
+#else
+    int count = (int)lua_objlen(L, 1);
+#endif
+    if (context->table_schema_index == 0) {
+        lua_createtable(L, 0, 5);
+        lua_createtable(L, 0, 3);
+        pushPythonFunction(L, schema_list);
+        lua_setfield(L, -2, "list");
+        pushPythonFunction(L, schema_record);
+        lua_setfield(L, -2, "record");
+        pushPythonFunction(L, schema_records);
+        lua_setfield(L, -2, "records");
+        lua_setfield(L, -2, "__index");
+        pushPythonFunction(L, schema_call);
+        lua_setfield(L, -2, "__call");
+        pushPythonFunction(L, python_tostring);
+        lua_setfield(L, -2, "__tostring");
+        lua_pushcfunction(L, schema_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushstring(L, PYTHON_SCHEMA_NAME);
+        lua_setfield(L, -2, "__name");
+        registerProxyMetatable(L, PROXY_SCHEMA);
+        context->table_schema_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    size_t size = sizeof(PythonSchema) + sizeof(PyObject*) * (count > 0 ? count - 1 : 0);
+    PythonSchema* schema = (PythonSchema*)lua_newuserdata(L, size + count);
+    schema->proxy.obj = NULL;
+    schema->proxy.kind = PROXY_SCHEMA;
+    schema->proxy.size = 0;
+    schema->names = LUA_NOREF;
+    schema->count = 0;
+    schema->kinds = (char*)schema + size;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_schema_index);
+    lua_setmetatable(L, -2);
+    lua_createtable(L, count, 0);
+    for (int i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        char kind = 'a';
+        if (lua_istable(L, -1)) {
+            lua_rawgeti(L, -1, 2);
+            kind = checkKind(L, -1, "python_schema");
+            lua_pop(L, 1);
+            lua_rawgeti(L, -1, 1);
+            lua_remove(L, -2);
+        }
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            luaL_error(L, "python_schema: Field name must be a string, got %s", luaL_typename(L, -1));
+            return 0;
+        }
+        schema->keys[i] = internStringPython(L, -1);
+        if (schema->keys[i] == NULL) {
+            PyErr_Print();
+            luaL_error(L, "python_schema: Failed to convert field name %s", lua_tostring(L, -1));
+            return 0;
+        }
+        schema->kinds[i] = kind;
+        schema->count = i + 1;
+        lua_rawseti(L, -2, i + 1);
+    }
+    schema->names = luaL_ref(L, LUA_REGISTRYINDEX);
+    Py_INCREF(target);
+    schema->proxy.obj = target;
+    return 1;
+}
@@ -0,0 +1,297 @@
+#include "luapython.h"
+
+// luapython.scope(fn, ...) runs fn and then releases every proxy created while it ran in one
+// pass, instead of leaving thousands of temporaries to the Lua collector. The proxies are marked
+// dead, so using one afterwards raises an error instead of touching a freed object. The values
+// fn returns are kept and move to the enclosing scope. luapython.scope() returns the handle for
+// a Lua 5.4 <close> variable, or for an explicit handle:close().
+
+// Scopes are kept per coroutine: context->scope_threads maps a thread to the arena of its
+// innermost open scope, so a coroutine that yields inside a scope does not catch the proxies
+// that other coroutines create meanwhile.
+
+#define SCOPE_KEEP_DEPTH 200
+
+typedef struct {
+    int arena;
+    int parent;
+    int thread;
+    int closed;
+} PythonScope;
+
+static PythonScope* toScope(lua_State* L, int index) {
+    PythonContext* context = getPythonContext(L);
+    PythonScope* scope = (PythonScope*)lua_touserdata(L, index);
+    if (scope == NULL || !lua_getmetatable(L, index)) {
+        return NULL;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_scope_index);
+    int same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return same ? scope : NULL;
+}
+
+// Drops the reference of the proxy at index and marks it dead.
+static void releaseProxy(lua_State* L, PythonContext* context, int index) {
+    PythonProxy* proxy = toPythonProxy(L, index);
+    if (proxy->obj == NULL) {
+        return;
+    }
+    uncacheLua(L, proxy->obj, index);
+    unaccountLua(context, proxy);
+#ifdef LUAPYTHON_HAS_BUFFER
+    if (proxy->kind == PROXY_BUFFER) {
+        releaseBufferView(context, proxy);
+    }
+#endif
+    releaseLater(context, proxy->obj);
+    proxy->obj = NULL;
+}
+
+// Makes the parent of scope the innermost scope of its thread again and drops its references.
+static void popScope(lua_State* L, PythonContext* context, PythonScope* scope) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->scope_threads);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, scope->thread);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, scope->parent);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, scope->thread);
+    luaL_unref(L, LUA_REGISTRYINDEX, scope->parent);
+    scope->closed = 1;
+    context->scope_count--;
+}
+
+// Whether scope is the innermost open scope of its thread.
+static int isInnermost(lua_State* L, PythonContext* context, PythonScope* scope) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->scope_threads);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, scope->thread);
+    lua_rawget(L, -2);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, scope->arena);
+    int same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 3);
+    return same;
+}
+
+int scope_close(lua_State* L) {
+    PythonScope* scope = toScope(L, 1);
+    if (scope == NULL) {
+        luaL_error(L, "scope_close: Python scope expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    if (scope->closed) {
+        return 0;
+    }
+    PythonContext* context = getPythonContext(L);
+    if (!isInnermost(L, context, scope)) {
+        luaL_error(L, "scope_close: Inner scopes must be closed first");
+        return 0;
+    }
+    popScope(L, context, scope);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, scope->arena);
+    int arena = lua_gettop(L);
+    lua_pushnil(L);
+    while (lua_next(L, arena) != 0) {
+        lua_pop(L, 1);
+        releaseProxy(L, context, -1);
+    }
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, scope->arena);
+    releasePending(context);
+    return 0;
+}
+
+// A handle dropped without closing it stops recording, its proxies are left to the collector.
+static int scope_gc(lua_State* L) {
+    PythonScope* scope = (PythonScope*)lua_touserdata(L, 1);
+    PythonContext* context = getPythonContext(L);
+    if (!scope->closed) {
+        // An inner scope still open keeps its own reference to this arena as its parent.
+        if (isInnermost(L, context, scope)) {
+            popScope(L, context, scope);
+        } else {
+            luaL_unref(L, LUA_REGISTRYINDEX, scope->thread);
+            luaL_unref(L, LUA_REGISTRYINDEX, scope->parent);
+            scope->closed = 1;
+            context->scope_count--;
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, scope->arena);
+    }
+    return 0;
+}
+
+// Pushes a handle for a new innermost scope of the running thread.
+static PythonScope* pushScopeLua(lua_State* L) {
+    PythonContext* context = getPythonContext(L);
+    if (context->scope_threads == 0) {
+        lua_newtable(L);
+        context->scope_threads = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    if (context->table_scope_index == 0) {
+        lua_createtable(L, 0, 3);
+        lua_createtable(L, 0, 1);
+        pushPythonFunction(L, scope_close);
+        lua_setfield(L, -2, "close");
+        lua_setfield(L, -2, "__index");
+#if LUA_VERSION_NUM >= 504
+        pushPythonFunction(L, scope_close);
+        lua_setfield(L, -2, "__close");
+#endif
+        lua_pushcfunction(L, scope_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushstring(L, PYTHON_SCOPE_NAME);
+        lua_setfield(L, -2, "__name");
+        context->table_scope_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    PythonScope* scope = (PythonScope*)lua_newuserdata(L, sizeof(PythonScope));
+    scope->closed = 1;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_scope_index);
+    lua_setmetatable(L, -2);
+    // Weak keys, so a scope does not keep its proxies from being collected before it closes.
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, context->scope_threads);
+    lua_pushthread(L);
+    lua_pushthread(L);
+    lua_rawget(L, -3);
+    // LUA_REFNIL when the thread had no open scope, which pushes nil again on close.
+    scope->parent = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    scope->arena = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushthread(L);
+    scope->thread = luaL_ref(L, LUA_REGISTRYINDEX);
+    scope->closed = 0;
+    context->scope_count++;
+    return scope;
+}
+
+typedef struct {
+    int arena;
+    int parent;
+    int seen;
+} KeepState;
+
+// Moves the proxy at index out of the scope into its parent, and those in a table at index with
+// its keys and values, down to SCOPE_KEEP_DEPTH levels.
+static void keepValue(lua_State* L, int index, KeepState* keep, int depth) {
+    int type = lua_type(L, index);
+    if (type == LUA_TUSERDATA) {
+        lua_pushvalue(L, index);
+        lua_rawget(L, keep->arena);
+        int recorded = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (!recorded) {
+            return;
+        }
+        lua_pushvalue(L, index);
+        lua_pushnil(L);
+        lua_rawset(L, keep->arena);
+        if (keep->parent != 0) {
+            lua_pushvalue(L, index);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, keep->parent);
+        }
+        return;
+    }
+    if (type != LUA_TTABLE || depth >= SCOPE_KEEP_DEPTH) {
+        return;
+    }
+    lua_pushvalue(L, index);
+    lua_rawget(L, keep->seen);
+    int seen = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (seen) {
+        return;
+    }
+    lua_pushvalue(L, index);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, keep->seen);
+    luaL_checkstack(L, 4, "keepValue: Table too deep");
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        int top = lua_gettop(L);
+        keepValue(L, top - 1, keep, depth + 1);
+        keepValue(L, top, keep, depth + 1);
+        lua_pop(L, 1);
+    }
+}
+
+// Moves the proxies among the values from first to the top out of the scope, into its parent.
+static void keepValues(lua_State* L, PythonScope* scope, int first) {
+    int top = lua_gettop(L);
+    KeepState keep;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, scope->arena);
+    keep.arena = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, scope->parent);
+    keep.parent = lua_istable(L, -1) ? lua_gettop(L) : 0;
+    lua_newtable(L);
+    keep.seen = lua_gettop(L);
+    for (int i = first; i <= top; i++) {
+        keepValue(L, i, &keep, 0);
+    }
+    lua_settop(L, top);
+}
+
+// luapython.release(proxy) releases one proxy now, as closing its scope would. For a buffer view
+// this ends the export, so the object can be resized again.
+int python_release(lua_State* L) {
+    if (!isPythonObject(L, 1)) {
+        luaL_error(L, "python_release: Python object expected, got %s", luaL_typename(L, 1));
+        return 0;
+    }
+    PythonContext* context = getPythonContext(L);
+    releaseProxy(L, context, 1);
+    releasePending(context);
+    return 0;
+}
+
+// Keeps the values fn returned and closes the scope at index 1, then rethrows an error of fn.
+static int finishScope(lua_State* L, int status) {
+    PythonScope* scope = (PythonScope*)lua_touserdata(L, 1);
+    int ok = status == LUA_OK || status == LUA_YIELD;
+    if (ok) {
+        keepValues(L, scope, 2);
+    }
+    lua_getfield(L, 1, "close");
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 0);
+    if (!ok) {
+        lua_error(L);
+        return 0;
+    }
+    return lua_gettop(L) - 1;
+}
+
+#if LUA_VERSION_NUM >= 503
+static int scope_continue(lua_State* L, int status, lua_KContext ctx) {
+    (void)ctx;
+    return finishScope(L, status);
+}
+#elif LUA_VERSION_NUM == 502
+static int scope_continue(lua_State* L) {
+    int ctx;
+    return finishScope(L, lua_getctx(L, &ctx));
+}
+#endif
+
+// Not wrapped by the GIL, fn takes it as it needs it and only closing the scope holds it. fn may
+// yield, for example in luapython.await, since Lua 5.2; the scope closes when it returns.
+int python_scope(lua_State* L) {
+    if (lua_isnoneornil(L, 1)) {
+        pushScopeLua(L);
+        return 1;
+    }
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    pushScopeLua(L);
+    lua_insert(L, 1);
+#if LUA_VERSION_NUM >= 502
+    int status = lua_pcallk(L, lua_gettop(L) - 2, LUA_MULTRET, 0, 0, scope_continue);
+#else
+    int status = lua_pcall(L, lua_gettop(L) - 2, LUA_MULTRET, 0);
+#endif
+    return finishScope(L, status);
+}
@@ -1,6 +1,6 @@
 #include "luapython.h"
 
-#define isPythonSet(L, index) (isPythonObject(L, index) && PySet_Check(*(PyObject**)lua_touserdata(L, index)))
+#define isPythonSet(L, index) isPythonKind(L, index, PROXY_SET)
 
 int set_len(lua_State* L) {
     if (!(lua_istable(L, -1) || isPythonSet(L, -1))) {
@@ -156,44 +156,50 @@ int set_band(lua_State* L) {
     return 1;
 }
 
-int table_set_index = 0;
-
 int pushSetLua(lua_State* L, PyObject* obj) {
+    PythonContext* context = getPythonContext(L);
     if (!PySet_Check(obj)) {
         luaL_error(L, "pushSetLua: Failed to set metatable for set");
         return 0;
     }
-    if (table_set_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = obj;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_set_index);
+    if (context->table_set_index != 0) {
+        if (pushCachedLua(L, obj, context->table_set_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = obj;
+        proxy->kind = PROXY_SET;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_set_index);
         if (!lua_istable(L, -1)) {
             luaL_error(L, "pushSetLua: Internal error, class index is not a table");
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, obj);
         return 1;
     }
     lua_createtable(L, 0, 9);
-    lua_pushcfunction(L, set_add);
+    pushPythonFunction(L, set_add);
     lua_setfield(L, -2, "__add");
-    lua_pushcfunction(L, set_mul);
+    pushPythonFunction(L, set_mul);
     lua_setfield(L, -2, "__mul");
-    lua_pushcfunction(L, set_sub);
+    pushPythonFunction(L, set_sub);
     lua_setfield(L, -2, "__sub");
-    lua_pushcfunction(L, set_band);
+    pushPythonFunction(L, set_band);
     lua_setfield(L, -2, "__band");
-    lua_pushcfunction(L, set_index);
+    pushPythonFunction(L, set_index);
     lua_setfield(L, -2, "__index");
-    lua_pushcfunction(L, set_newindex);
+    pushPythonFunction(L, set_newindex);
     lua_setfield(L, -2, "__newindex");
-    lua_pushcfunction(L, python_tostring);
+    pushPythonFunction(L, python_tostring);
     lua_setfield(L, -2, "__tostring");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
     lua_pushstring(L, PYTHON_SET_NAME);
     lua_setfield(L, -2, "__name");
-    table_set_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_SET);
+    context->table_set_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushSetLua(L, obj);
 }
 
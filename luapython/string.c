@@ -1,6 +1,6 @@
 #include "luapython.h"
 
-#define isPythonString(L, index) (isPythonObject(L, index) && PyUnicode_Check(*(PyObject**)lua_touserdata(L, index)))
+#define isPythonString(L, index) isPythonKind(L, index, PROXY_STRING)
 
 int string_concat(lua_State* L) {
     if (!(lua_isstring(L, -1) || isPythonString(L, -1)) || !(lua_isstring(L, -2) || isPythonString(L, -2))) {
@@ -236,9 +236,8 @@ int string_mul(lua_State* L) {
     return 1;
 }
 
-int table_string_index = 0;
-
 int pushStringLua(lua_State* L, PyObject* obj) {
+    PythonContext* context = getPythonContext(L);
     if (!PyUnicode_Check(obj)) {
         luaL_error(L, "pushStringLua: Expected a Python string object");
         return 1;
@@ -251,37 +250,44 @@ int pushStringLua(lua_State* L, PyObject* obj) {
         Py_DECREF(bytes);
         return 1;
     }
-    if (table_string_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = obj;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_string_index);
+    if (context->table_string_index != 0) {
+        if (pushCachedLua(L, obj, context->table_string_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = obj;
+        proxy->kind = PROXY_STRING;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_string_index);
         if (!lua_istable(L, -1)) {
             luaL_error(L, "pushStringLua: Internal error, class index is not a table");
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, obj);
         return 1;
     }
     lua_createtable(L, 0, 9);
-    lua_pushcfunction(L, string_concat);
+    pushPythonFunction(L, string_concat);
     lua_setfield(L, -2, "__concat");
-    lua_pushcfunction(L, string_len);
+    pushPythonFunction(L, string_len);
     lua_setfield(L, -2, "__len");
-    lua_pushcfunction(L, string_eq);
+    pushPythonFunction(L, string_eq);
     lua_setfield(L, -2, "__eq");
-    lua_pushcfunction(L, string_lt);
+    pushPythonFunction(L, string_lt);
     lua_setfield(L, -2, "__lt");
-    lua_pushcfunction(L, string_le);
+    pushPythonFunction(L, string_le);
     lua_setfield(L, -2, "__le");
-    lua_pushcfunction(L, string_tostring);
+    pushPythonFunction(L, string_tostring);
     lua_setfield(L, -2, "__tostring");
-    lua_pushcfunction(L, string_mul);
+    pushPythonFunction(L, string_mul);
     lua_setfield(L, -2, "__mul");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
     lua_pushstring(L, PYTHON_STRING_NAME);
     lua_setfield(L, -2, "__name");
-    table_string_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_STRING);
+    context->table_string_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushStringLua(L, obj);
 }
 
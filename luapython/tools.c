@@ -1,11 +1,6 @@
 #include "tools.h"
 #include "luapython.h"
 
-int tools_should_convert_to_dict = -1;
-int tools_release_to_env = -1;
-int tools_get_python_adapt_function = -1;
-int tools_get_iter_function = -1;
-
 int luapython_astable(lua_State* L) {
     if(!isPythonObject(L, -1)) {
         luaL_error(L, "luapython_astable: Not a Python object");
@@ -77,7 +72,236 @@ int luapython_astable(lua_State* L) {
     return 1;
 }
 
+// luapython.totable(obj, {depth=, strings=}) converts a JSON-like graph of dicts, lists and
+// tuples into nested Lua tables in one pass, without a proxy or an iterator per container.
+// Other values are pushed as pushLua would, so they stay proxies. Below depth levels containers
+// are left as proxies too, and depth is capped at TOTABLE_MAX_DEPTH since containers recurse on the
+// C stack. A container reached twice becomes one table, which keeps shared objects shared and
+// cycles finite, unless it is reached again with more levels left than its table was built with.
+// With strings="dedup" (the default) every str object is encoded once,
+// which pays off for the keys json.loads shares between records.
+
+#define TOTABLE_MAX_DEPTH 200
+
+typedef struct {
+    int strings;
+    int tables;
+    int depths;
+    int subclasses;
+} TotableState;
+
+// Pushes the UTF-8 of str as a Lua string, or nil when it can not be encoded.
+void pushUtf8Lua(lua_State* L, PyObject* str) {
+#ifdef LUAPYTHON_HAS_UTF8
+    Py_ssize_t size;
+    const char* utf8 = PyUnicode_AsUTF8AndSize(str, &size);
+    if(utf8) {
+        lua_pushlstring(L, utf8, size);
+        return;
+    }
+    PyErr_Clear();
+#endif
+    PyObject* bytes = PyUnicode_AsEncodedString(str, "utf-8", "surrogateescape");
+    if(bytes == NULL) {
+        PyErr_Clear();
+        lua_pushnil(L);
+        return;
+    }
+    lua_pushlstring(L, PyBytes_AsString(bytes), PyBytes_Size(bytes));
+    Py_DECREF(bytes);
+}
+
+static void pushStrLua(lua_State* L, PyObject* str, TotableState* state) {
+    if(state->strings == 0) {
+        pushUtf8Lua(L, str);
+        return;
+    }
+    lua_pushlightuserdata(L, str);
+    lua_rawget(L, state->strings);
+    if(!lua_isnil(L, -1)) {
+        return;
+    }
+    lua_pop(L, 1);
+    pushUtf8Lua(L, str);
+    lua_pushlightuserdata(L, str);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, state->strings);
+}
+
+static void pushTreeLua(lua_State* L, PyObject* obj, int depth, TotableState* state);
+
+// Records the table on top of the stack as the one built for obj with depth levels, before its
+// items are filled, so a container reached again through a shared reference or a cycle reuses it.
+static void rememberTable(lua_State* L, PyObject* obj, int depth, TotableState* state) {
+    lua_pushlightuserdata(L, obj);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, state->tables);
+    lua_pushlightuserdata(L, obj);
+    lua_pushinteger(L, depth);
+    lua_rawset(L, state->depths);
+}
+
+// Pushes the table built for obj if it was built with at least depth levels. Returns 0 otherwise.
+static int pushRememberedLua(lua_State* L, PyObject* obj, int depth, TotableState* state) {
+    lua_pushlightuserdata(L, obj);
+    lua_rawget(L, state->depths);
+    int found = !lua_isnil(L, -1) && lua_tointeger(L, -1) >= depth;
+    lua_pop(L, 1);
+    if(!found) {
+        return 0;
+    }
+    lua_pushlightuserdata(L, obj);
+    lua_rawget(L, state->tables);
+    return 1;
+}
+
+static void pushSequenceLua(lua_State* L, PyObject* obj, int list, int depth, TotableState* state) {
+    PyObject* source = obj;
+#ifdef Py_GIL_DISABLED
+    // Other threads may resize a list while Lua fills the table, so walk a private copy.
+    obj = list ? PyList_GetSlice(obj, 0, PY_SSIZE_T_MAX) : Py_NewRef(obj);
+#else
+    Py_INCREF(obj);
+#endif
+    if(obj == NULL) {
+        PyErr_Clear();
+        lua_pushnil(L);
+        return;
+    }
+    Py_ssize_t size = list ? PyList_Size(obj) : PyTuple_Size(obj);
+    lua_createtable(L, (int)size, 0);
+    rememberTable(L, source, depth, state);
+    for(Py_ssize_t index = 0; index < size; index++) {
+        pushTreeLua(L, list ? PyList_GetItem(obj, index) : PyTuple_GetItem(obj, index), depth - 1, state);
+        lua_rawseti(L, -2, (lua_Integer)index + 1);
+    }
+    Py_DECREF(obj);
+}
+
+static void pushMappingLua(lua_State* L, PyObject* obj, int depth, TotableState* state) {
+    PyObject* source = obj;
+#ifdef Py_GIL_DISABLED
+    obj = PyDict_Copy(obj);
+#else
+    Py_INCREF(obj);
+#endif
+    if(obj == NULL) {
+        PyErr_Clear();
+        lua_pushnil(L);
+        return;
+    }
+    lua_createtable(L, 0, (int)PyDict_Size(obj));
+    rememberTable(L, source, depth, state);
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while(PyDict_Next(obj, &pos, &key, &value)) {
+        pushTreeLua(L, key, 0, state);
+        // None and NaN keys can not index a Lua table.
+        if(lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1))) {
+            lua_pop(L, 1);
+            continue;
+        }
+        pushTreeLua(L, value, depth - 1, state);
+        lua_rawset(L, -3);
+    }
+    Py_DECREF(obj);
+}
+
+// Pushes obj, converting containers into tables while depth is positive. obj is borrowed.
+static void pushTreeLua(lua_State* L, PyObject* obj, int depth, TotableState* state) {
+    luaL_checkstack(L, 4, "luapython_totable: Structure too deep");
+    if(obj == NULL || Py_IsNone(obj)) {
+        lua_pushnil(L);
+        return;
+    }
+    if(obj == Py_True || obj == Py_False) {
+        lua_pushboolean(L, obj == Py_True);
+        return;
+    }
+    if(PyUnicode_CheckExact(obj)) {
+        pushStrLua(L, obj, state);
+        return;
+    }
+    if(PyLong_CheckExact(obj)) {
+        long number = PyLong_AsLong(obj);
+        if(!PyErr_Occurred()) {
+            lua_pushinteger(L, number);
+            return;
+        }
+        PyErr_Clear();
+    } else if(PyFloat_CheckExact(obj)) {
+        lua_pushnumber(L, PyFloat_AsDouble(obj));
+        return;
+    } else if(depth > 0) {
+        if(pushRememberedLua(L, obj, depth, state)) {
+            return;
+        }
+        if(PyDict_CheckExact(obj) || (state->subclasses && PyDict_Check(obj))) {
+            pushMappingLua(L, obj, depth, state);
+            return;
+        }
+        if(PyList_CheckExact(obj) || (state->subclasses && PyList_Check(obj))) {
+            pushSequenceLua(L, obj, 1, depth, state);
+            return;
+        }
+        if(PyTuple_CheckExact(obj) || (state->subclasses && PyTuple_Check(obj))) {
+            pushSequenceLua(L, obj, 0, depth, state);
+            return;
+        }
+    }
+    Py_INCREF(obj);
+    pushLua(L, obj);
+}
+
+int luapython_totable(lua_State* L) {
+    if(!isPythonObject(L, 1)) {
+        luaL_error(L, "luapython_totable: Not a Python object");
+        return 0;
+    }
+    int depth = TOTABLE_MAX_DEPTH;
+    int dedup = 1;
+    if(lua_istable(L, 2)) {
+        lua_getfield(L, 2, "depth");
+        if(!lua_isnil(L, -1)) {
+            lua_Integer requested = luaL_checkinteger(L, -1);
+            depth = requested < TOTABLE_MAX_DEPTH ? (int)requested : TOTABLE_MAX_DEPTH;
+        }
+        lua_getfield(L, 2, "strings");
+        if(!lua_isnil(L, -1)) {
+            const char* strings = luaL_checkstring(L, -1);
+            if(strcmp(strings, "dedup") == 0) {
+                dedup = 1;
+            } else if(strcmp(strings, "copy") == 0) {
+                dedup = 0;
+            } else {
+                luaL_error(L, "luapython_totable: Unknown strings mode '%s'", strings);
+                return 0;
+            }
+        }
+        lua_pop(L, 2);
+    } else if(!lua_isnoneornil(L, 2)) {
+        luaL_error(L, "luapython_totable: Options table expected, got %s", luaL_typename(L, 2));
+        return 0;
+    }
+    lua_settop(L, 1);
+    TotableState state;
+    lua_newtable(L);
+    state.tables = lua_gettop(L);
+    lua_newtable(L);
+    state.depths = lua_gettop(L);
+    state.strings = 0;
+    // A registered converter for a subclass wins over the fast paths.
+    state.subclasses = getPythonContext(L)->converter_count == 0;
+    if(dedup) {
+        lua_newtable(L);
+        state.strings = lua_gettop(L);
+    }
+    pushTreeLua(L, toPythonProxy(L, 1)->obj, depth, &state);
+    return 1;
+}
+
 void loadTools(lua_State* L){
+    PythonContext* context = getPythonContext(L);
     if(luaL_dostring(L, "return require \"luapython.tools\"") != LUA_OK){
         luaL_error(L, "loadTools: Failed to load internal tools");
     }
@@ -89,29 +313,23 @@ void loadTools(lua_State* L){
     }else{
         luaL_error(L, "loadtools: table expected, got %s", luaL_typename(L, -1));
     }
-    lua_pushstring(L, "shouldConvertToDict");
-    lua_rawget(L, index);
-    if(!lua_isfunction(L, -1)){
-        luaL_error(L, "loadTools: index shouldConvertToDict - function expected, got %s", luaL_typename(L, -1));
-    }
-    tools_should_convert_to_dict = luaL_ref(L, LUA_REGISTRYINDEX);
     lua_pushstring(L, "releaseToEnv");
     lua_rawget(L, index);
     if(!lua_isfunction(L, -1)){
         luaL_error(L, "loadTools: index releaseToEnv - function expected, got %s", luaL_typename(L, -1));
     }
-    tools_release_to_env = luaL_ref(L, LUA_REGISTRYINDEX);
-    lua_pushstring(L, "getPythonAdaptFunction");
+    context->tools_release_to_env = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushstring(L, "getIterFunction");
     lua_rawget(L, index);
     if(!lua_isfunction(L, -1)){
-        luaL_error(L, "loadTools: index getPythonAdaptFunction - function expected, got %s", luaL_typename(L, -1));
+        luaL_error(L, "loadTools: index getIterFunction - function expected, got %s", luaL_typename(L, -1));
     }
-    tools_get_python_adapt_function = luaL_ref(L, LUA_REGISTRYINDEX);
-    lua_pushstring(L, "getIterFunction");
+    context->tools_get_iter_function = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushstring(L, "getAwaitFunction");
     lua_rawget(L, index);
     if(!lua_isfunction(L, -1)){
-        luaL_error(L, "loadTools: index getIterFunction - function expected, got %s", luaL_typename(L, -1));
+        luaL_error(L, "loadTools: index getAwaitFunction - function expected, got %s", luaL_typename(L, -1));
     }
-    tools_get_iter_function = luaL_ref(L, LUA_REGISTRYINDEX);
+    context->tools_get_await_function = luaL_ref(L, LUA_REGISTRYINDEX);
     lua_pop(L, -(index+1));
 }
@@ -2,22 +2,6 @@ local functions = ({ ... })[0]
 
 local tools = {}
 
-function tools.shouldConvertToDict(obj)
-    if type(obj) ~= "table" then
-        error("tools.lua: table expected, got " .. type(obj))
-    end
-    local ncount = 0
-    local scount = 0
-    for i, _ in pairs(obj) do
-        if type(i) == "number" then
-            ncount = ncount + 1
-        elseif type(i) == "string" then
-            scount = scount + 1
-        end
-    end
-    return scount >= ncount
-end
-
 function tools.releaseToEnv(luapython, env, key)
     if env == nil and key == nil then
         env = _G
@@ -48,25 +32,6 @@ function tools.releaseToEnv(luapython, env, key)
     end
 end
 
-function tools.getPythonAdaptFunction(python_function)
-    if type(python_function) ~= "function" then
-        error("tools.lua: function expected, got " .. type(python_function))
-    end
-    local adaptfunction = function(self, ...)
-        local args = { ... }
-        local n = #args
-        local arg_dict = args[n]
-        if type(arg_dict) == "table" and tools.shouldConvertToDict(arg_dict) then
-            args[n] = nil
-            n = n - 1
-        else
-            arg_dict = {}
-        end
-        return python_function(self, args, arg_dict, n)
-    end
-    return adaptfunction
-end
-
 function tools.getIterFunction(iter, get)
     if type(iter) ~= "function" then
         error("tools.lua: first argument is not a function")
@@ -82,4 +47,25 @@ function tools.getIterFunction(iter, get)
     return iter_func
 end
 
+local function isYieldable()
+    if coroutine.isyieldable then
+        return coroutine.isyieldable()
+    end
+    local co, main = coroutine.running()
+    return co ~= nil and not main
+end
+
+function tools.getAwaitFunction(schedule, step, finish)
+    return function(awaitable)
+        local task = schedule(awaitable)
+        if isYieldable() then
+            -- Hand the task to the scheduler and advance the event loop whenever resumed
+            while not step(task) do
+                coroutine.yield(task)
+            end
+        end
+        return finish(task)
+    end
+end
+
 return tools
@@ -47,41 +47,48 @@ int tuple_index(lua_State* L) {
         return 1;
     }
     PyObject* py_value = PyTuple_GetItem(py_tuple, py_index);
+    Py_XINCREF(py_value);
     Py_XDECREF(py_tuple);
     pushLua(L, py_value);
     return 1;
 }
 
-int table_tuple_index = 0;
-
 int pushTupleLua(lua_State* L, PyObject* obj) {
+    PythonContext* context = getPythonContext(L);
     if (!PyTuple_Check(obj)) {
         luaL_error(L, "pushTupleLua: Not a tuple");
         return 0;
     }
-    if (table_tuple_index != 0) {
-        void* point = lua_newuserdata(L, sizeof(PyObject*));
-        *(PyObject**)point = obj;
-        lua_rawgeti(L, LUA_REGISTRYINDEX, table_tuple_index);
+    if (context->table_tuple_index != 0) {
+        if (pushCachedLua(L, obj, context->table_tuple_index)) {
+            return 1;
+        }
+        PythonProxy* proxy = (PythonProxy*)lua_newuserdata(L, sizeof(PythonProxy));
+        proxy->obj = obj;
+        proxy->kind = PROXY_TUPLE;
+        proxy->size = 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, context->table_tuple_index);
         if (!lua_istable(L, -1)) {
             luaL_error(L, "pushClassLua: Internal error, class index is not a table");
             return 0;
         }
         lua_setmetatable(L, -2);
+        cacheLua(L, obj);
         return 1;
     }
     lua_createtable(L, 0, 5);
-    lua_pushcfunction(L, tuple_len);
+    pushPythonFunction(L, tuple_len);
     lua_setfield(L, -2, "__len");
-    lua_pushcfunction(L, tuple_index);
+    pushPythonFunction(L, tuple_index);
     lua_setfield(L, -2, "__index");
-    lua_pushcfunction(L, python_tostring);
+    pushPythonFunction(L, python_tostring);
     lua_setfield(L, -2, "__tostring");
     lua_pushcfunction(L, python_gc);
     lua_setfield(L, -2, "__gc");
     lua_pushstring(L, PYTHON_TUPLE_NAME);
     lua_setfield(L, -2, "__name");
-    table_tuple_index = luaL_ref(L, LUA_REGISTRYINDEX);
+    registerProxyMetatable(L, PROXY_TUPLE);
+    context->table_tuple_index = luaL_ref(L, LUA_REGISTRYINDEX);
     return pushTupleLua(L, obj);
 }
 